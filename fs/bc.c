@@ -104,6 +104,28 @@ flush_block(void *addr)
 	// panic("flush_block not implemented");
 }
 
+// Give the block cache a page of its own for the block at addr if
+// anything else maps its page, such as an image (see fs/image.c), so
+// that changing the block leaves the other mappings as they are.
+void
+bc_unshare(void *addr)
+{
+	int r;
+
+	addr = ROUNDDOWN(addr, PGSIZE);
+	if (!va_is_mapped(addr) || pageref(addr) <= 1)
+		return;
+	// The copy is not dirty, so write out what the block has first
+	flush_block(addr);
+	if ((r = sys_page_alloc(0, UTEMP, PTE_P | PTE_U | PTE_W)) < 0)
+		panic("in bc_unshare, sys_page_alloc: %e", r);
+	memmove(UTEMP, addr, BLKSIZE);
+	if ((r = sys_page_map(0, UTEMP, 0, addr, PTE_P | PTE_U | PTE_W)) < 0)
+		panic("in bc_unshare, sys_page_map: %e", r);
+	if ((r = sys_page_unmap(0, UTEMP)) < 0)
+		panic("in bc_unshare, sys_page_unmap: %e", r);
+}
+
 // Test that the block cache works, by smashing the superblock and
 // reading it back.
 static void
@@ -76,6 +76,8 @@ alloc_block(void)
 		{
 			bitmap[i / 32] ^= 1 << (i % 32);
 			flush_block(&bitmap[i / 32]);
+			// An image may still hold the block's old contents
+			bc_unshare(diskaddr(i));
 			return i;
 		}
 	}
@@ -407,15 +409,16 @@ file_write(struct File *f, const void *buf, size_t count, off_t offset)
 	off_t pos;
 	char *blk;
 
-	// Extend file if necessary
-	if (offset + count > f->f_size)
-		if ((r = file_set_size(f, offset + count)) < 0)
-			return r;
+	// Extend file if necessary.  This also starts a new version of f
+	// (see fs/image.c) before any of its blocks change.
+	if ((r = file_set_size(f, MAX(f->f_size, offset + count))) < 0)
+		return r;
 
 	for (pos = offset; pos < offset + count; ) {
 		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
 			return r;
 		bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
+		bc_unshare(blk);
 		memmove(blk + pos % BLKSIZE, buf, bn);
 		pos += bn;
 		buf += bn;
@@ -469,9 +472,11 @@ file_truncate_blocks(struct File *f, off_t newsize)
 }
 
 // Set the size of file f, truncating or extending as necessary.
+// file_write() relies on this starting a new version of f.
 int
 file_set_size(struct File *f, off_t newsize)
 {
+	image_file_changed(f);
 	if (f->f_size > newsize)
 		file_truncate_blocks(f, newsize);
 	f->f_size = newsize;
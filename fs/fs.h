@@ -26,6 +26,7 @@ void*	diskaddr(uint32_t blockno);
 bool	va_is_mapped(void *va);
 bool	va_is_dirty(void *va);
 void	flush_block(void *addr);
+void	bc_unshare(void *addr);
 void	bc_init(void);
 
 /* fs.c */
@@ -40,6 +41,13 @@ void	file_flush(struct File *f);
 int	file_remove(const char *path);
 void	fs_sync(void);
 
+/* serv.c */
+bool	openfile_in_use(struct File *f, uint32_t version);
+
+/* image.c */
+int	image_map(struct File *f, uint32_t version, off_t offset, void **pg_store);
+void	image_file_changed(struct File *f);
+
 /* int	map_block(uint32_t); */
 bool	block_is_free(uint32_t blockno);
 int	alloc_block(void);
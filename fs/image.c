@@ -0,0 +1,151 @@
+// Executable image cache.
+//
+// read_map() hands out the block cache pages of program files, so all
+// the envs running a program share the same physical pages of its
+// text.  An env pages its program in bit by bit (see lib/pager.c),
+// though, possibly after the file has been written, so read_map()
+// maps a file as of the version the client opened (f_version).  The
+// pages handed out are kept per file and version in an image, mapped
+// at a window of their own.  Before a file with an image of its
+// current version changes, every block of it is put in the image,
+// and then changed only in a new copy of the block cache page (see
+// bc_unshare()), so the image keeps the old version for the envs
+// already running it, and read_map() of the new version starts a new
+// image.  Images no env has open any more are recycled least recently
+// used first.
+
+#include "fs.h"
+
+#define NIMAGE		16
+#define IMAGEVA		0xE0000000	// Window of image i at IMAGEVA +
+#define IMAGESIZE	0x00800000	// i * IMAGESIZE, >= MAXFILESIZE
+
+struct Image {
+	struct File *im_file;		// NULL if free
+	uint32_t im_version;		// Version of im_file held
+	off_t im_end;			// End of the pages mapped
+	uint32_t im_used;		// When last used, for recycling
+};
+
+static struct Image images[NIMAGE];
+static uint32_t image_clock;
+
+static void *
+image_va(struct Image *im, off_t offset)
+{
+	return (void *) (IMAGEVA + (im - images) * IMAGESIZE + offset);
+}
+
+static struct Image *
+image_lookup(struct File *f, uint32_t version)
+{
+	struct Image *im;
+
+	for (im = images; im < images + NIMAGE; im++)
+		if (im->im_file == f && im->im_version == version)
+			return im;
+	return NULL;
+}
+
+// Take a free image, or the least recently used one no open file is
+// paging from.  Returns NULL if every image is in use.
+static struct Image *
+image_alloc(struct File *f)
+{
+	struct Image *im, *lru = NULL;
+	off_t off;
+
+	for (im = images; im < images + NIMAGE; im++) {
+		if (!im->im_file) {
+			lru = im;
+			break;
+		}
+		if ((!lru || im->im_used < lru->im_used)
+		    && !openfile_in_use(im->im_file, im->im_version))
+			lru = im;
+	}
+	if (!lru)
+		return NULL;
+
+	im = lru;
+	for (off = 0; off < im->im_end; off += BLKSIZE)
+		sys_page_unmap(0, image_va(im, off));
+	im->im_file = f;
+	im->im_version = f->f_version;
+	im->im_end = 0;
+	return im;
+}
+
+// Map the block at 'offset' of the current version of f into im.
+static int
+image_fill(struct Image *im, off_t offset)
+{
+	char *blk;
+	int r;
+
+	if (va_is_mapped(image_va(im, offset)))
+		return 0;
+	if ((r = file_get_block(im->im_file, offset / BLKSIZE, &blk)) < 0)
+		return r;
+	// Read the block in from disk, if it is not cached yet
+	(void) *(volatile char *) blk;
+	if ((r = sys_page_map(0, blk, 0, image_va(im, offset),
+			      PTE_P | PTE_U)) < 0)
+		return r;
+	im->im_end = MAX(im->im_end, offset + BLKSIZE);
+	return 0;
+}
+
+// Set *pg_store to the page of version 'version' of f at 'offset',
+// which must be block-aligned.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_NOT_FOUND if that version of f is no longer cached.
+//	-E_NO_MEM if every image is in use.
+//	Errors from file_get_block() or sys_page_map().
+int
+image_map(struct File *f, uint32_t version, off_t offset, void **pg_store)
+{
+	struct Image *im;
+	int r;
+
+	if (!(im = image_lookup(f, version))) {
+		if (version != f->f_version)
+			return -E_NOT_FOUND;
+		if (!(im = image_alloc(f)))
+			return -E_NO_MEM;
+	}
+	im->im_used = ++image_clock;
+
+	if (!va_is_mapped(image_va(im, offset))) {
+		// An old version has all its blocks in the image
+		if (version != f->f_version)
+			return -E_NOT_FOUND;
+		if ((r = image_fill(im, offset)) < 0)
+			return r;
+	}
+	*pg_store = image_va(im, offset);
+	return 0;
+}
+
+// f is about to change: keep the version envs may be running in its
+// image, if it has one, and start a new version.
+void
+image_file_changed(struct File *f)
+{
+	struct Image *im;
+	off_t off;
+	int r;
+
+	if ((im = image_lookup(f, f->f_version)))
+		for (off = 0; off < f->f_size; off += BLKSIZE)
+			if ((r = image_fill(im, off)) < 0) {
+				// Envs can no longer page in the old version
+				cprintf("image_file_changed: %e\n", r);
+				for (off = 0; off < im->im_end; off += BLKSIZE)
+					sys_page_unmap(0, image_va(im, off));
+				im->im_file = NULL;
+				break;
+			}
+	f->f_version++;
+}
@@ -96,6 +96,20 @@ openfile_lookup(envid_t envid, uint32_t fileid, struct OpenFile **po)
 	return 0;
 }
 
+// Is version 'version' of f still open by some env?  The programs
+// spawned from f keep it open for their pagers.
+bool
+openfile_in_use(struct File *f, uint32_t version)
+{
+	int i;
+
+	for (i = 0; i < MAXOPEN; i++)
+		if (opentab[i].o_file == f && pageref(opentab[i].o_fd) > 1
+		    && opentab[i].o_fd->fd_file.version == version)
+			return 1;
+	return 0;
+}
+
 // Open req->req_path in mode req->req_omode, storing the Fd page and
 // permissions to return to the calling environment in *pg_store and
 // *perm_store respectively.
@@ -161,6 +175,7 @@ try_open:
 
 	// Fill out the Fd structure
 	o->o_fd->fd_file.id = o->o_fileid;
+	o->o_fd->fd_file.version = f->f_version;
 	o->o_fd->fd_omode = req->req_omode & O_ACCMODE;
 	o->o_fd->fd_dev_id = devfile.dev_id;
 	o->o_mode = req->req_omode;
@@ -300,27 +315,29 @@ serve_sync(envid_t envid, union Fsipc *req)
 	return 0;
 }
 
+// Map the block of req->req_fileid at req->req_offset, as of version
+// req->req_version, read-only into the caller, from the image cache
+// (see fs/image.c) so that every env running a program shares it.
 int 
 serve_read_map(envid_t envid, struct Fsreq_read_map *req, 
 	void **pg_store, int *perm_store)
 {
 	struct OpenFile *o;
-	char *blk;
+	void *pg;
 	int r;
 
 	if (req->req_perm & PTE_W)
 		return -E_INVAL;
 	if (req->req_offset % BLKSIZE)
 		return -E_INVAL;
-	int blkno = req->req_offset / BLKSIZE;
 
 	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
 		return r;
-	if ((r = file_get_block(o->o_file, blkno, &blk)) < 0)
+	if ((r = image_map(o->o_file, req->req_version, req->req_offset,
+			   &pg)) < 0)
 		return r;
-	memcpy(blk, blk, PGSIZE); // load the block from the disk
 
-	*pg_store = blk;
+	*pg_store = pg;
 	*perm_store = req->req_perm;
 
 	return 0;	
@@ -9,6 +9,8 @@
 
 typedef int32_t envid_t;
 
+struct waitqueue;
+
 // An environment ID 'envid_t' has three parts:
 //
 // +1+---------------21-----------------+--------10--------+
@@ -44,31 +46,52 @@ enum EnvType {
 	ENV_TYPE_FS,		// File system server
 };
 
+// The fields are grouped by who writes them, one group per cache line,
+// so that CPUs scheduling an env, running it and sending it IPC do not
+// keep stealing each other's lines.
 struct Env {
-	struct Trapframe env_tf;	// Saved registers
-	struct Env *env_link;		// Next free Env
+	// Scheduling (protected by env_table_lock), written by any CPU
+	// that makes the env runnable or picks it to run
 	envid_t env_id;			// Unique environment identifier
-	envid_t env_parent_id;		// env_id of this env's parent
-	enum EnvType env_type;		// Indicates special system environments
 	unsigned env_status;		// Status of the environment
 	uint32_t env_runs;		// Number of times environment has run
 	int env_cpunum;			// The CPU that the env is running on
+	struct Env *env_runq_next;	// Next env on the same run queue
+	int env_runq_cpu;		// CPU whose run queue holds us, or -1
+	uint32_t env_cpumask;		// CPUs we may run on (bit n: CPU n)
+	struct waitqueue *env_wait_queue; // Wait queue we sleep on, or NULL
+	struct Env *env_wait_next;	// Next env on the same wait queue
+	uintptr_t env_wait_key;		// What we wait for within the queue
+
+	// Saved registers, written by the CPU running the env on every
+	// trap
+	struct Trapframe env_tf __attribute__((aligned(CACHELINE)));
 
-	// Address space
+	// Rarely written
+	struct Env *env_link;		// Next free Env
+	envid_t env_parent_id;		// env_id of this env's parent
+	enum EnvType env_type;		// Indicates special system environments
+
+	// Address space (protected by the env's lock)
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
+	uint32_t env_pgfaults;		// Page faults resolved by the kernel
+	uint32_t env_faults_avoided;	// Pages mapped ahead by fault-around
 
 	// Exception handling
 	void *env_pgfault_upcall;	// Page fault upcall entry point
+	uintptr_t env_pagein_va;	// Page a system call needs paged in
 
-	// Lab 4 IPC
-	bool env_ipc_recving;		// Env is blocked receiving
+	// Lab 4 IPC (protected by ipc_lock), written by senders
+	bool env_ipc_recving __attribute__((aligned(CACHELINE)));
+					// Env is blocked receiving
 	void *env_ipc_dstva;		// VA at which to map received page
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+	envid_t env_ipc_recv_from;	// Only receive from this env, if set
 
 	struct Env *env_ipc_queue; // the head of IPC waiting queue (this is receiver)
 	struct Env *env_ipc_next; // next waiting environment in the same waiting queue (this is sender)
-};
+} __attribute__((aligned(CACHELINE)));
 
 #endif // !JOS_INC_ENV_H
@@ -16,6 +16,8 @@ enum {
 
 	E_IPC_NOT_RECV	,	// Attempt to send to env that is not recving
 	E_EOF		,	// Unexpected end of file
+	E_TIMEOUT	,	// Wait timed out
+	E_PAGEIN	,	// Memory had to be paged in first: try again
 
 	// File system error codes -- only seen in user-level
 	E_NO_DISK	,	// No free space left on disk
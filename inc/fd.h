@@ -27,6 +27,7 @@ struct Dev {
 
 struct FdFile {
 	int id;
+	uint32_t version;	// f_version of the file when opened
 };
 
 struct Fd {
@@ -36,9 +36,11 @@ struct File {
 	uint32_t f_direct[NDIRECT];	// direct blocks
 	uint32_t f_indirect;		// indirect block
 
+	uint32_t f_version;		// bumped by each change to the data
+
 	// Pad out to 256 bytes; must do arithmetic in case we're compiling
 	// fsformat on a 64-bit machine.
-	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 4];
+	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 4 - 4];
 } __attribute__((packed));	// required only on some 64-bit machines
 
 // An inode block contains exactly BLKFILES 'struct File's
@@ -114,6 +116,7 @@ union Fsipc {
 		int req_fileid;
 		off_t req_offset;
 		int req_perm;
+		uint32_t req_version;	// File version to map from
 	} read_map;
 
 	// Ensure Fsipc is one page
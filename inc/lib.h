@@ -26,18 +26,41 @@
 // main user program
 void	umain(int argc, char **argv);
 
-// libmain.c or entry.S
+// libmain.c or globals.S
 extern const char *binaryname;
 extern const volatile struct Env *thisenv;
 extern const volatile struct Env envs[NENV];
 extern const volatile struct PageInfo pages[];
+extern const volatile struct UStats ustats;
 
 // exit.c
 void	exit(void);
 
+// batch.c
+// System calls queued up for a sys_batch(), in sb_calls[0..sb_n).
+struct SyscallBatch {
+	struct Syscall *sb_calls;
+	int sb_n;
+	int sb_max;
+};
+
+int	batch_add(struct SyscallBatch *b, int num, uint32_t a1, uint32_t a2,
+		  uint32_t a3, uint32_t a4, uint32_t a5);
+int	batch_flush(struct SyscallBatch *b);
+
+// ring.c
+int	ring_open(void);
+int	ring_submit(int num, uint32_t a1, uint32_t a2, uint32_t a3,
+		    uint32_t a4, uint32_t a5);
+int	ring_reap(struct RingCompletion *rc, bool wait);
+
 // pgfault.c
 void	set_pgfault_handler(void (*handler)(struct UTrapframe *utf));
 
+// pager.c
+bool	pager_active(void);
+void	pager_prefault(const void *va, size_t len);
+
 // readline.c
 char*	readline(const char *buf);
 
@@ -47,16 +70,33 @@ int	sys_cgetc(void);
 envid_t	sys_getenvid(void);
 int	sys_env_destroy(envid_t);
 void	sys_yield(void);
+void	sys_yield_to(envid_t env);
 static envid_t sys_exofork(void);
+envid_t	sys_fork(void);
+int	sys_exec(envid_t env, const void *image, size_t len);
 int	sys_env_set_status(envid_t env, int status);
+int	sys_env_set_affinity(envid_t env, uint32_t cpumask);
 int	sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
 int	sys_env_set_pgfault_upcall(envid_t env, void *upcall);
+int	sys_env_set_faultaround(envid_t env, int npages);
 int	sys_page_alloc(envid_t env, void *pg, int perm);
 int	sys_page_map(envid_t src_env, void *src_pg,
 		     envid_t dst_env, void *dst_pg, int perm);
 int	sys_page_unmap(envid_t env, void *pg);
+int	sys_region_reserve(envid_t env, void *va, size_t len, int perm);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_recv_from(envid_t from_env, void *rcv_pg);
+int	sys_cgetc_wait(void);
+int	sys_env_wait(envid_t env);
+int	sys_futex_wait(const volatile void *addr, uint32_t expected,
+		       uint32_t timeout);
+int	sys_futex_wake(const volatile void *addr, int n);
+int	sys_sleep(uint32_t usec);
+uint64_t sys_time(void);
+int	sys_batch(struct Syscall *calls, int n, int flags);
+int	sys_ring_setup(void *va);
+int	sys_ring_enter(int flags);
 
 // This must be inlined.  Exercise for reader: why?
 // to prevent the return value in %eax from being overriden
@@ -76,7 +116,6 @@ int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
 envid_t	ipc_find_env(enum EnvType type);
 
 // fork.c
-#define	PTE_SHARE	0x400
 envid_t	fork(void);
 envid_t	sfork(void);	// Challenge!
 
@@ -17,6 +17,8 @@
 #define GD_UT     0x18     // user text
 #define GD_UD     0x20     // user data
 #define GD_TSS0   0x28     // Task segment selector for CPU 0
+#define GD_KCPU0  0x68     // Per-CPU data segment for CPU 0, after the
+                           // NCPU TSS selectors
 
 /*
  * Virtual memory map:                                Permissions
@@ -50,6 +52,8 @@
  *    UVPT      ---->  +------------------------------+ 0xef400000
  *                     |          RO PAGES            | R-/R-  PTSIZE
  *    UPAGES    ---->  +------------------------------+ 0xef000000
+ *    USTATS    ---->  |         RO STATS             | R-/R-  PGSIZE
+ *                     |- - - - - - - - - - - - - - - |
  *                     |           RO ENVS            | R-/R-  PTSIZE
  * UTOP,UENVS ------>  +------------------------------+ 0xeec00000
  * UXSTACKTOP -/       |     User Exception Stack     | RW/RW  PGSIZE
@@ -114,6 +118,8 @@
 #define UPAGES		(UVPT - PTSIZE)
 // Read-only copies of the global env structures
 #define UENVS		(UPAGES - PTSIZE)
+// Read-only time and scheduler statistics, in the last page of UENVS
+#define USTATS		(UPAGES - PGSIZE)
 
 /*
  * Top of user VM. User can manipulate VA from UTOP-1 and down!
@@ -126,6 +132,9 @@
 // Next page left invalid to guard against exception stack overflow; then:
 // Top of normal user stack
 #define USTACKTOP	(UTOP - 2*PGSIZE)
+// Room below USTACKTOP that the normal user stack grows into on demand
+// (see sys_region_reserve)
+#define USTACKSIZE	(32*PGSIZE)
 
 // Where user programs generally begin
 #define UTEXT		(2*PTSIZE)
@@ -138,6 +147,20 @@
 // The location of the user-level STABS data structure
 #define USTABDATA	(PTSIZE / 2)
 
+// libjos, which lib/lib.ld links here, up to PFTEMP, and which the
+// kernel maps into every env (see kern/shlib.c)
+#define ULIB		(UTEMP + PTSIZE / 2)
+
+// A program that spawn() loads lazily pages itself in with the pager
+// in libjos (see lib/pager.c), and with the pages below ULIB:
+// The pager's description of the program file, a struct PagerInfo
+#define UPAGERINFO	(ULIB - PGSIZE)
+// The program file's struct Fd, which keeps the file open
+#define UPAGERFD	(UPAGERINFO - PGSIZE)
+// The pager's file server request, and its temporary mapping
+#define UPAGERREQ	(UPAGERFD - PGSIZE)
+#define UPAGERTEMP	(UPAGERREQ - PGSIZE)
+
 // Physical address of startup code for non-boot CPUs (APs)
 #define MPENTRY_PADDR	0x7000
 
@@ -187,5 +210,55 @@ struct PageInfo {
 	uint16_t pp_ref;
 };
 
+/*
+ * Time and scheduler statistics, mapped at USTATS.
+ * Read/write to the kernel, read-only to user programs, so that user
+ * code can read the time or the load without a system call.
+ *
+ * The kernel updates the counters without any lock, so a 64-bit
+ * counter must be read until two reads agree.  The TSC frequency and
+ * offset are constant after boot: microseconds since boot are
+ * (rdtsc - us_tsc_boot) * 1000000 / us_tsc_freq.
+ */
+#define USTATS_NCPU	8
+
+struct UStatsCpu {
+	uint32_t usc_runq_len;		// Envs on this CPU's run queue
+	uint64_t usc_idle;		// TSC cycles spent halted
+} __attribute__((aligned(CACHELINE)));
+
+struct UStats {
+	uint32_t us_ticks;		// Timer ticks since boot
+	uint32_t us_ncpu;		// Number of CPUs
+	uint64_t us_tsc_freq;		// TSC cycles per second
+	uint64_t us_tsc_boot;		// TSC at boot
+	struct UStatsCpu us_cpus[USTATS_NCPU];
+	uint32_t us_sysenter;		// System calls may use SYSENTER
+};
+
+/*
+ * What spawn() tells a program it loads lazily about the program file,
+ * at UPAGERINFO: the segments that the program's pager (lib/pager.c)
+ * pages in.  The kernel reads it too, to have the pager page in the
+ * memory a system call is passed (see user_arg_check() in kern/pmap.c).
+ */
+struct PagerSeg {
+	uintptr_t ps_va;		// Segment start, as in its Proghdr
+	uintptr_t ps_fend;		// End of its file data
+	uintptr_t ps_end;		// End of the segment in memory
+	off_t ps_offset;		// File offset of ps_va
+	int ps_perm;			// PTE_P | PTE_U, with PTE_W if writable
+};
+
+#define PAGER_NSEG	8
+
+struct PagerInfo {
+	int32_t pi_fsenv;		// envid of the file server holding it
+	int pi_fileid;			// The program file's open file ID
+	uint32_t pi_version;		// and the version it was opened at
+	int pi_nseg;
+	struct PagerSeg pi_seg[PAGER_NSEG];
+};
+
 #endif /* !__ASSEMBLER__ */
 #endif /* !JOS_INC_MEMLAYOUT_H */
@@ -1,6 +1,8 @@
 #ifndef JOS_INC_SYSCALL_H
 #define JOS_INC_SYSCALL_H
 
+#include <inc/types.h>
+
 /* system call numbers */
 enum {
 	SYS_cputs = 0,
@@ -17,7 +19,66 @@ enum {
 	SYS_yield,
 	SYS_ipc_try_send,
 	SYS_ipc_recv,
+	SYS_cgetc_wait,
+	SYS_env_wait,
+	SYS_futex_wait,
+	SYS_futex_wake,
+	SYS_sleep,
+	SYS_time,
+	SYS_env_set_affinity,
+	SYS_yield_to,
+	SYS_batch,
+	SYS_ring_setup,
+	SYS_ring_enter,
+	SYS_fork,
+	SYS_region_reserve,
+	SYS_env_set_faultaround,
+	SYS_exec,
+	SYS_ipc_recv_from,
 	NSYSCALLS
 };
 
+// One system call of a sys_batch().
+struct Syscall {
+	uint32_t sc_num;		// SYS_*
+	uint32_t sc_args[5];
+	int32_t sc_ret;			// Result, filled in by the kernel
+};
+
+// sys_batch() flags
+#define BATCH_STOPONERR	0x1		// Stop after the first call that fails
+
+// A system call ring: a page an env shares with the kernel, registered
+// with sys_ring_setup(), to make system calls without trapping.  The
+// env fills in sr_sq[sr_sq_tail % RING_NSQ] and then advances
+// sr_sq_tail; the kernel takes submissions from sr_sq_head on, on the
+// env's next kernel entry, and posts each result at
+// sr_cq[sr_cq_tail % RING_NCQ], completing sleeps from an idle CPU.
+// The env consumes completions by advancing sr_cq_head.  Indices run
+// freely and wrap.
+//
+// Only SYS_page_alloc, SYS_page_map, SYS_page_unmap, SYS_ipc_try_send
+// and SYS_sleep may be submitted.  A send only succeeds if the target
+// is already waiting in sys_ipc_recv(), and a sleep completes once its
+// time is up; an env has at most one sleep outstanding.
+#define RING_NSQ	64
+#define RING_NCQ	64
+
+struct RingCompletion {
+	uint32_t rc_seq;		// Index of the submission in sr_sq
+	int32_t rc_ret;			// Its result
+};
+
+struct SyscallRing {
+	volatile uint32_t sr_sq_head;	// Next submission the kernel takes
+	volatile uint32_t sr_sq_tail;	// Next free submission slot
+	volatile uint32_t sr_cq_head;	// Next completion the env reads
+	volatile uint32_t sr_cq_tail;	// Next completion the kernel posts
+	struct Syscall sr_sq[RING_NSQ];
+	struct RingCompletion sr_cq[RING_NCQ];
+};
+
+// sys_ring_enter() flags
+#define RING_WAIT	0x1		// Sleep until a completion is posted
+
 #endif /* !JOS_INC_SYSCALL_H */
@@ -38,6 +38,7 @@
 #define IRQ_SPURIOUS     7
 #define IRQ_IDE         14
 #define IRQ_ERROR       19
+#define IRQ_RESCHED     20	// IPI: new work on this CPU's run queue
 
 #ifndef __ASSEMBLER__
 
@@ -57,6 +58,8 @@ struct PushRegs {
 
 struct Trapframe {
 	struct PushRegs tf_regs;
+	uint16_t tf_gs;
+	uint16_t tf_padding0;
 	uint16_t tf_es;
 	uint16_t tf_padding1;
 	uint16_t tf_ds;
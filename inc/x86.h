@@ -248,6 +248,12 @@ read_tsc(void)
 	return tsc;
 }
 
+static inline void
+wrmsr(uint32_t msr, uint64_t val)
+{
+	asm volatile("wrmsr" : : "c" (msr), "A" (val));
+}
+
 static inline uint32_t
 xchg(volatile uint32_t *addr, uint32_t newval)
 {
@@ -261,4 +267,28 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 	return result;
 }
 
+// Atomically compare *addr with oldval and, if equal, store newval.
+// Returns the value *addr held before the operation.
+static inline uint32_t
+cmpxchg(volatile uint32_t *addr, uint32_t oldval, uint32_t newval)
+{
+	uint32_t result;
+
+	asm volatile("lock; cmpxchgl %2, %1"
+		     : "=a" (result), "+m" (*addr)
+		     : "r" (newval), "0" (oldval)
+		     : "cc", "memory");
+	return result;
+}
+
+// Atomically add 'delta' to *addr and return the previous value.
+static inline uint32_t
+xadd(volatile uint32_t *addr, uint32_t delta)
+{
+	asm volatile("lock; xaddl %0, %1"
+		     : "+r" (delta), "+m" (*addr)
+		     : : "cc", "memory");
+	return delta;
+}
+
 #endif /* !JOS_INC_X86_H */
@@ -9,10 +9,17 @@
 #include <kern/console.h>
 #include <kern/trap.h>
 #include <kern/picirq.h>
+#include <kern/spinlock.h>
+#include <kern/sched.h>
 // PIC: Programmable Interrupt Chip
 
-static void cons_intr(int (*proc)(void));
-static void cons_putc(int c);
+static bool cons_intr(int (*proc)(void));
+
+// Serializes the console devices and the input buffer between CPUs.
+// cprintf() holds it for a whole message so lines don't interleave.
+struct spinlock cons_lock = SPINLOCK_INITIALIZER("cons_lock", LOCK_RANK_CONS, SPINLOCK_TICKET);
+
+struct waitqueue cons_wq;
 
 // Stupid I/O delay routine necessitated by historical PC design flaws
 // CPU can't send request faster than the speed at which the IO device could process
@@ -63,8 +70,15 @@ serial_proc_data(void)
 void
 serial_intr(void)
 {
-	if (serial_exists)
-		cons_intr(serial_proc_data);
+	bool input;
+
+	if (serial_exists) {
+		spin_lock(&cons_lock);
+		input = cons_intr(serial_proc_data);
+		spin_unlock(&cons_lock);
+		if (input)
+			wq_wakeup(&cons_wq, -1, 0);
+	}
 }
 
 static void
@@ -370,7 +384,10 @@ kbd_proc_data(void)
 	// Process special keys
 	// Ctrl-Alt-Del: reboot
 	if (!(~shift & (CTL | ALT)) && c == KEY_DEL) {
-		cprintf("Rebooting!\n");
+		// cons_lock is held here, so cprintf() can't be used
+		const char *msg;
+		for (msg = "Rebooting!\n"; *msg; msg++)
+			cons_putc(*msg);
 		outb(0x92, 0x3); // courtesy of Chris Frost
 		// 0x92: PS/2 system control port A
 	}
@@ -381,7 +398,13 @@ kbd_proc_data(void)
 void
 kbd_intr(void)
 {
-	cons_intr(kbd_proc_data);
+	bool input;
+
+	spin_lock(&cons_lock);
+	input = cons_intr(kbd_proc_data);
+	spin_unlock(&cons_lock);
+	if (input)
+		wq_wakeup(&cons_wq, -1, 0);
 }
 
 static void
@@ -409,10 +432,13 @@ static struct {
 
 // called by device interrupt routines to feed input characters
 // into the circular console input buffer.
-static void
+// Returns whether any characters were added.
+// The caller must hold cons_lock.
+static bool
 cons_intr(int (*proc)(void))
 {
 	int c;
+	bool added = 0;
 
 	while ((c = (*proc)()) != -1) {
 		if (c == 0)
@@ -420,7 +446,9 @@ cons_intr(int (*proc)(void))
 		cons.buf[cons.wpos++] = c;
 		if (cons.wpos == CONSBUFSIZE)
 			cons.wpos = 0;
+		added = 1;
 	}
+	return added;
 }
 
 // return the next input character from the console, or 0 if none waiting
@@ -429,24 +457,30 @@ cons_getc(void)
 {
 	int c;
 
+	spin_lock(&cons_lock);
+
 	// poll for any pending input characters,
 	// so that this function works even when interrupts are disabled
 	// (e.g., when called from the kernel monitor).
-	serial_intr();
-	kbd_intr();
+	if (serial_exists)
+		cons_intr(serial_proc_data);
+	cons_intr(kbd_proc_data);
 
 	// grab the next character from the input buffer.
+	c = 0;
 	if (cons.rpos != cons.wpos) {
 		c = cons.buf[cons.rpos++];
 		if (cons.rpos == CONSBUFSIZE)
 			cons.rpos = 0;
-		return c;
 	}
-	return 0;
+
+	spin_unlock(&cons_lock);
+	return c;
 }
 
 // output a character to the console
-static void
+// The caller must hold cons_lock.
+void
 cons_putc(int c)
 {
 	static int color = 0;
@@ -558,7 +592,9 @@ cons_init(void)
 void
 cputchar(int c)
 {
+	spin_lock(&cons_lock);
 	cons_putc(c);
+	spin_unlock(&cons_lock);
 }
 
 int
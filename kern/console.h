@@ -19,8 +19,12 @@
 
 void cons_init(void);
 int cons_getc(void);
+void cons_putc(int c);	// caller must hold cons_lock
 
 void kbd_intr(void); // irq 1
 void serial_intr(void); // irq 4
 
+// Envs waiting for console input; woken by the input interrupts.
+extern struct waitqueue cons_wq;
+
 #endif /* _CONSOLE_H_ */
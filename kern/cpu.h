@@ -7,6 +7,8 @@
 #include <inc/mmu.h>
 #include <inc/env.h>
 
+struct kthread;
+
 // Maximum number of CPUs
 #define NCPU  8
 
@@ -17,15 +19,27 @@ enum {
 	CPU_HALTED,
 };
 
-// Per-CPU state
+// Per-CPU state.  Each CPU's entry starts on its own cache line, so
+// that updating one CPU's status or run queue does not invalidate the
+// line another CPU is reading its own fields from.
 struct CpuInfo {
+	struct CpuInfo *cpu_self;       // Points here; read through %gs
 	uint8_t cpu_id;                 // Local APIC ID; index into cpus[] below
 	volatile unsigned cpu_status;   // The status of the CPU
 	struct Env *cpu_env;            // The currently-running environment.
+	struct Env *cpu_runq_head;      // Run queue of ENV_RUNNABLE envs,
+	struct Env *cpu_runq_tail;      // linked by env_runq_next; all run
+					// queues share env_table_lock
+	int cpu_runq_len;
+	uint64_t cpu_halt_tsc;          // TSC when the CPU last halted
+	envid_t cpu_fpu_owner;          // Env whose state the FPU holds, or 0
+	bool cpu_fpu_dirty;             // FPU changed since it was last saved
+	struct kthread *cpu_kthread;    // The currently-running kernel thread
+	bool cpu_kthread_turn;          // Normal kernel threads' turn next?
 	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
 	// interrupts on different CPU share the same address space
 	// seems no effort is made to prevent cpu_ts from crossing page boundary
-};
+} __attribute__((aligned(CACHELINE)));
 
 // Initialized in mpconfig.c
 extern struct CpuInfo cpus[NCPU];
@@ -36,13 +50,40 @@ extern physaddr_t lapicaddr;        // Physical MMIO address of the local APIC
 // Per-CPU kernel stacks
 extern unsigned char percpu_kstacks[NCPU][KSTKSIZE];
 
-int cpunum(void);
-#define thiscpu (&cpus[cpunum()])
+// %gs holds a per-CPU segment based at this CPU's struct CpuInfo,
+// whose first field points back at it (see percpu_init()), so finding
+// the current CPU is a single %gs-relative load rather than a read of
+// the LAPIC ID register.
+static inline struct CpuInfo *
+mycpu(void)
+{
+	struct CpuInfo *c;
+
+	asm volatile("movl %%gs:0, %0" : "=r" (c));
+	return c;
+}
+
+// Index of the current CPU in cpus[]
+static inline int
+cpunum(void)
+{
+	return mycpu() - cpus;
+}
+
+#define thiscpu (mycpu())
+
+void percpu_init(int i);
+
+// False sharing microbenchmark (kern/lockbench.c); run by every CPU at
+// boot when the kernel is built with -DBENCH_LAYOUT.
+void layout_bench(void);
+int lapic_id(void);
 
 void mp_init(void);
 void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(int apicid, int vector);
 
 #endif
@@ -14,10 +14,33 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/syscall.h>
+#include <kern/fpu.h>
+#include <kern/kthread.h>
+#include <kern/ring.h>
+#include <kern/region.h>
+#include <kern/shlib.h>
 
 struct Env *envs = NULL;		// All environments
 static struct Env *env_free_list;	// Free environment list
 					// (linked by Env->env_link)
+static struct Env *env_reap_list;	// Dying envs left to free, also
+					// linked by Env->env_link
+
+// Protects env_free_list and every env's env_status, which is also
+// what the scheduler decides on, so it doubles as the scheduler lock.
+struct spinlock env_table_lock =
+	SPINLOCK_INITIALIZER("env_table_lock", LOCK_RANK_SCHED, SPINLOCK_MCS);
+
+// Per-env locks, indexed like envs[].  An env's lock protects its
+// page tables and trap frame against concurrent syscalls from other
+// CPUs.  Kept out of struct Env since that is also mapped to users.
+static struct spinlock env_locks[NENV];
+
+struct waitqueue env_exit_wq;
+
+struct kthread *env_reaper;
+static void env_reaper_main(void *arg);
 
 #define ENVGENSHIFT	12		// >= LOGNENV
 
@@ -36,7 +59,7 @@ static struct Env *env_free_list;	// Free environment list
 // definition of gdt specifies the Descriptor Privilege Level (DPL)
 // of that descriptor: 0 for kernel and 3 for user.
 //
-struct Segdesc gdt[NCPU + 5] =
+struct Segdesc gdt[2 * NCPU + 5] =
 {
 	// 0x0 - unused (always faults -- for trapping NULL far pointers)
 	SEG_NULL,
@@ -55,7 +78,11 @@ struct Segdesc gdt[NCPU + 5] =
 
 	// Per-CPU TSS descriptors (starting from GD_TSS0) are initialized
 	// in trap_init_percpu()
-	[GD_TSS0 >> 3] = SEG_NULL
+	[GD_TSS0 >> 3] = SEG_NULL,
+
+	// Per-CPU data segments (starting from GD_KCPU0) are initialized
+	// in percpu_init()
+	[GD_KCPU0 >> 3] = SEG_NULL
 };
 
 struct Pseudodesc gdt_pd = {
@@ -108,6 +135,44 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	return 0;
 }
 
+//
+// Like envid2env, but also acquires the env's lock on success.
+// The env is checked again under the lock, so it cannot be freed
+// (and its slot reused) while the caller works on it.
+// Release the lock with unlock_env().
+//
+int
+envid2env_lock(envid_t envid, struct Env **env_store, bool checkperm)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = envid2env(envid, &e, checkperm)) < 0)
+		return r;
+
+	lock_env(e);
+	if (e->env_status == ENV_FREE || (envid != 0 && e->env_id != envid)) {
+		unlock_env(e);
+		*env_store = 0;
+		return -E_BAD_ENV;
+	}
+
+	*env_store = e;
+	return 0;
+}
+
+void
+lock_env(struct Env *e)
+{
+	spin_lock(&env_locks[e - envs]);
+}
+
+void
+unlock_env(struct Env *e)
+{
+	spin_unlock(&env_locks[e - envs]);
+}
+
 // Mark all environments in 'envs' as free, set their env_ids to 0,
 // and insert them into the env_free_list.
 // Make sure the environments are in the free list in the same order
@@ -125,8 +190,15 @@ env_init(void)
 		envs[i].env_status = ENV_FREE;
 		envs[i].env_id = 0;
 		if (i) envs[i - 1].env_link = &envs[i];
+		__spin_initlock(&env_locks[i], "env_lock", LOCK_RANK_ENV, SPINLOCK_TAS);
 	}
 
+	// Dying envs are freed by a kernel thread that runs when a CPU
+	// has nothing else to do
+	if (kthread_create(&env_reaper, "reaper", env_reaper_main, NULL,
+			   KTHREAD_PRIO_IDLE) < 0)
+		panic("env_init: cannot create the reaper");
+
 	// Per-CPU part of the initialization
 	env_init_percpu();
 }
@@ -136,9 +208,8 @@ void
 env_init_percpu(void)
 {
 	lgdt(&gdt_pd);
-	// The kernel never uses GS or FS, so we leave those set to
-	// the user data segment.
-	asm volatile("movw %%ax,%%gs" : : "a" (GD_UD|3));
+	// The kernel never uses FS, so we leave it set to the user data
+	// segment.  GS holds the per-CPU segment loaded by percpu_init().
 	asm volatile("movw %%ax,%%fs" : : "a" (GD_UD|3));
 	// The kernel does use ES, DS, and SS.  We'll change between
 	// the kernel and user data segments as needed.
@@ -217,12 +288,23 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	int r;
 	struct Env *e;
 
-	if (!(e = env_free_list))
-		return -E_NO_FREE_ENV;
+	spin_lock(&env_table_lock);
+	while (!(e = env_free_list)) {
+		if (!env_reap_list) {
+			spin_unlock(&env_table_lock);
+			return -E_NO_FREE_ENV;
+		}
+		// Free a dying env now rather than wait for the reaper
+		spin_unlock(&env_table_lock);
+		env_reap(1);
+		spin_lock(&env_table_lock);
+	}
 
 	// Allocate and set up the page directory for this environment.
-	if ((r = env_setup_vm(e)) < 0)
+	if ((r = env_setup_vm(e)) < 0) {
+		spin_unlock(&env_table_lock);
 		return r;
+	}
 
 	// Generate an env_id for this environment.
 	generation = (e->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
@@ -233,8 +315,20 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
 	e->env_type = ENV_TYPE_USER;
-	e->env_status = ENV_RUNNABLE;
+	// Not runnable until the caller has set up its registers;
+	// otherwise another CPU could pick it up half-built.
+	e->env_status = ENV_NOT_RUNNABLE;
 	e->env_runs = 0;
+	e->env_pgfaults = 0;
+	e->env_faults_avoided = 0;
+	e->env_runq_next = NULL;
+	e->env_runq_cpu = -1;
+	e->env_cpumask = ~0;
+	e->env_wait_queue = NULL;
+	e->env_wait_next = NULL;
+	e->env_wait_key = 0;
+	fpu_env_init(e);
+	region_env_init(e);
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -252,6 +346,7 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// (DPL) stored in the descriptors themselves.
 	e->env_tf.tf_ds = GD_UD | 3;
 	e->env_tf.tf_es = GD_UD | 3;
+	e->env_tf.tf_gs = GD_UD | 3;
 	e->env_tf.tf_ss = GD_UD | 3;
 	e->env_tf.tf_esp = USTACKTOP;
 	e->env_tf.tf_cs = GD_UT | 3;
@@ -273,6 +368,7 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 
 	// commit the allocation
 	env_free_list = e->env_link;
+	spin_unlock(&env_table_lock);
 	*newenv_store = e;
 
 	// cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
@@ -319,6 +415,120 @@ region_alloc(struct Env *e, void *va, size_t len)
 	}
 }
 
+//
+// Map the loadable segments of the ELF image at 'binary', at most 'len'
+// bytes long, into e's address space, with the permissions their
+// program headers ask for, and store the entry point in *entry_store.
+// Each page that holds file data gets a copy of it, with the rest of
+// the page zeroed; pages past the file data are left demand-zero (see
+// kern/region.c).
+//
+// If 'src' is not NULL, the image is mapped page-aligned in src's
+// address space, which must be the one loaded.  Read-only pages with
+// nothing but file data in them are then mapped from the image instead
+// of copied, so that envs running the same program share its text, and
+// pages whose file data src has not mapped are left unmapped, for a
+// program that pages itself in (see lib/pager.c).
+//
+// e must not be running, and gets no stack.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_NOT_EXEC if the image is not ELF, or a segment is malformed.
+//	-E_FAULT if src cannot read the ELF headers.
+//	-E_INVAL if a segment overlaps a region e has reserved.
+//	-E_NO_MEM on memory exhaustion.
+//
+int
+env_load_elf(struct Env *e, const uint8_t *binary, size_t len,
+	     struct Env *src, uintptr_t *entry_store)
+{
+	const struct Elf *elf = (const struct Elf *) binary;
+	const struct Proghdr *ph, *eph;
+	struct PageInfo *pp, *spp;
+	pte_t *pte;
+	uintptr_t va, fend, bss, end;
+	size_t lo, hi;
+	int perm, r;
+
+	if (len < sizeof(struct Elf) ||
+	    (src && user_mem_check(src, binary, sizeof(struct Elf), PTE_U) < 0) ||
+	    elf->e_magic != ELF_MAGIC ||
+	    elf->e_phoff > len ||
+	    elf->e_phnum > (len - elf->e_phoff) / sizeof(struct Proghdr))
+		return -E_NOT_EXEC;
+	ph = (const struct Proghdr *) (binary + elf->e_phoff);
+	eph = ph + elf->e_phnum;
+	if (src && user_mem_check(src, ph, (eph - ph) * sizeof(*ph), PTE_U) < 0)
+		return -E_FAULT;
+
+	for (; ph < eph; ph++) {
+		if (ph->p_type != ELF_PROG_LOAD || ph->p_memsz == 0)
+			continue;
+		if (ph->p_filesz > ph->p_memsz ||
+		    ph->p_offset > len || ph->p_filesz > len - ph->p_offset ||
+		    ph->p_va >= UTOP || ph->p_memsz > UTOP - ph->p_va ||
+		    PGOFF(ph->p_offset) != PGOFF(ph->p_va))
+			return -E_NOT_EXEC;
+
+		perm = PTE_P | PTE_U;
+		if (ph->p_flags & ELF_PROG_FLAG_WRITE)
+			perm |= PTE_W;
+		fend = ph->p_va + ph->p_filesz;
+		end = ph->p_va + ph->p_memsz;
+		bss = ROUNDUP(fend, PGSIZE);
+
+		for (va = ROUNDDOWN(ph->p_va, PGSIZE); va < MIN(bss, end); va += PGSIZE) {
+			// Pages of a user image that src has not mapped are
+			// left unmapped, for the program to page in itself
+			spp = NULL;
+			if (src) {
+				lock_env(src);
+				spp = page_lookup(src->env_pgdir,
+						  (void *) (binary + ROUNDDOWN(ph->p_offset, PGSIZE) +
+							    (va - ROUNDDOWN(ph->p_va, PGSIZE))),
+						  &pte);
+				if (spp && (*pte & PTE_U))
+					page_incref(spp);
+				else
+					spp = NULL;
+				unlock_env(src);
+				if (!spp)
+					continue;
+			}
+
+			// Share a read-only page of the image as it is, unless
+			// part of it has to read as zero
+			if (spp && !(perm & PTE_W) && PGOFF(binary) == 0 &&
+			    MIN(va + PGSIZE, end) <= fend) {
+				r = page_insert(e->env_pgdir, spp, (void *) va, perm);
+				page_decref(spp);
+				if (r < 0)
+					return r;
+				continue;
+			}
+
+			lo = MAX(va, ph->p_va);
+			hi = MIN(va + PGSIZE, fend);
+			if ((pp = page_alloc(ALLOC_ZERO)))
+				memcpy(page2kva(pp) + (lo - va),
+				       binary + ph->p_offset + (lo - ph->p_va), hi - lo);
+			if (spp)
+				page_decref(spp);
+			if (!pp)
+				return -E_NO_MEM;
+			if ((r = page_insert(e->env_pgdir, pp, (void *) va, perm)) < 0) {
+				page_free(pp);
+				return r;
+			}
+		}
+		if (end > bss && (r = region_reserve(e, bss, end - bss, perm)) < 0)
+			return r;
+	}
+
+	*entry_store = elf->e_entry;
+	return 0;
+}
+
 //
 // Set up the initial program binary, stack, and processor flags
 // for a user process.
@@ -373,28 +583,23 @@ load_icode(struct Env *e, uint8_t *binary)
 	//  What?  (See env_run() and env_pop_tf() below.)
 
 	// LAB 3: Your code here.
-	lcr3(PADDR(e->env_pgdir));
-	if (((struct Elf *)binary)->e_magic != ELF_MAGIC)
-	{
-		panic("unrecoginized binary format");
-	}
-	struct Proghdr *ph, *eph;
-	ph = (struct Proghdr *) (binary + ((struct Elf *)binary)->e_phoff);
-	eph = ph + ((struct Elf *)binary)->e_phnum;
-	for (; ph < eph; ph++) if (ph->p_type == ELF_PROG_LOAD)
+	// The image is linked into the kernel, so its size is not known
+	uintptr_t entry;
+	int r = env_load_elf(e, binary, ~0U, NULL, &entry);
+	if (r < 0 || (r = shlib_map(e)) < 0)
 	{
-		region_alloc(e, (void *)ph->p_va, ph->p_memsz);
-		memcpy((void *)(ph->p_va), binary + ph->p_offset, ph->p_filesz);
-		memset((void *)(ph->p_va + ph->p_filesz), 0, ph->p_memsz - ph->p_filesz);
+		panic("load_icode: %e", r);
 	}
 
 	// Now map one page for the program's initial stack
-	// at virtual address USTACKTOP - PGSIZE.
+	// at virtual address USTACKTOP - PGSIZE, with room to grow below.
 
 	// LAB 3: Your code here.
 	region_alloc(e, (void *)(USTACKTOP - PGSIZE), PGSIZE);
-	e->env_tf.tf_eip = ((struct Elf *)binary)->e_entry;
-	lcr3(PADDR(kern_pgdir));
+	if (region_reserve(e, USTACKTOP - USTACKSIZE, USTACKSIZE - PGSIZE,
+			   PTE_P | PTE_U | PTE_W) < 0)
+		panic("load_icode: cannot reserve the stack");
+	e->env_tf.tf_eip = entry;
 }
 
 //
@@ -423,6 +628,10 @@ env_create(uint8_t *binary, enum EnvType type)
 	{
 		e->env_tf.tf_eflags |= FL_IOPL_3;
 	}
+
+	spin_lock(&env_table_lock);
+	sched_set_status(e, ENV_RUNNABLE);
+	spin_unlock(&env_table_lock);
 }
 
 //
@@ -434,6 +643,7 @@ env_free(struct Env *e)
 	pte_t *pt;
 	uint32_t pdeno, pteno;
 	physaddr_t pa;
+	envid_t envid = e->env_id;
 
 	// If freeing the current environment, switch to kern_pgdir
 	// before freeing the page directory, just in case the page
@@ -441,6 +651,9 @@ env_free(struct Env *e)
 	if (e == curenv)
 		lcr3(PADDR(kern_pgdir));
 
+	// Wait for any syscall working on e's address space to finish
+	lock_env(e);
+
 	// Note the environment's demise.
 	// cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
@@ -473,33 +686,128 @@ env_free(struct Env *e)
 	page_decref(pa2page(pa));
 
 	// return the environment to the free list
-	e->env_status = ENV_FREE;
+	spin_lock(&env_table_lock);
+	sched_set_status(e, ENV_FREE);
 	e->env_link = env_free_list;
 	env_free_list = e;
+	spin_unlock(&env_table_lock);
+
+	unlock_env(e);
+	wq_wakeup_key(&env_exit_wq, envid, -1, 0);
+}
+
+//
+// Hand the ENV_DYING env e, which no CPU is running any more, to the
+// reaper.  e is unlinked from IPC at once, but its address space is
+// torn down later by the reaper thread, on a CPU that has nothing
+// better to do.  If e is curenv, this CPU lets go of it.
+//
+void
+env_reap_later(struct Env *e)
+{
+	// Another CPU may free e's page directory as soon as e is on
+	// the reap list
+	if (e == curenv) {
+		lcr3(PADDR(kern_pgdir));
+		fpu_env_free(e);
+		curenv = NULL;
+	}
+
+	// Drop e out of any IPC queue and release its system call ring
+	// before anyone can look it up again
+	ipc_env_free(e);
+	ring_env_free(e);
+
+	spin_lock(&env_table_lock);
+	e->env_link = env_reap_list;
+	env_reap_list = e;
+	kthread_wakeup(env_reaper);
+	spin_unlock(&env_table_lock);
+}
+
+//
+// Free up to n envs from the reap list.  Returns the number freed.
+// Called without env_table_lock held.
+//
+int
+env_reap(int n)
+{
+	struct Env *e;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		spin_lock(&env_table_lock);
+		if ((e = env_reap_list) != NULL)
+			env_reap_list = e->env_link;
+		spin_unlock(&env_table_lock);
+		if (!e)
+			break;
+		env_free(e);
+	}
+	return i;
+}
+
+// The reaper thread: free dying envs a batch at a time, yielding in
+// between so that it does not hold up other work.  Once they are all
+// gone, go back to idle priority (sched_tick() raises it when no CPU
+// is idle) and sleep until env_reap_later() queues more.
+static void
+env_reaper_main(void *arg)
+{
+	while (1) {
+		while (env_reap(ENV_REAP_BATCH) > 0)
+			kthread_yield();
+		spin_lock(&env_table_lock);
+		kthread_set_prio(env_reaper, KTHREAD_PRIO_IDLE);
+		spin_unlock(&env_table_lock);
+		kthread_sleep();
+	}
+}
+
+// Are there envs left to reap?  Called with env_table_lock held.
+bool
+env_reap_pending(void)
+{
+	return env_reap_list != NULL;
 }
 
 //
-// Frees environment e.
+// Frees environment e.  The teardown itself is deferred to the reaper.
 // If e was the current env, then runs a new environment (and does not return
 // to the caller).
 //
 void
 env_destroy(struct Env *e)
 {
+	bool self;
+
+	spin_lock(&env_table_lock);
+
 	// If e is currently running on other CPUs, we change its state to
 	// ENV_DYING. A zombie environment will be freed the next time
 	// it traps to the kernel.
 	if (e->env_status == ENV_RUNNING && curenv != e) {
-		e->env_status = ENV_DYING;
+		sched_set_status(e, ENV_DYING);
+		spin_unlock(&env_table_lock);
 		return;
 	}
 
-	env_free(e);
+	// Somebody else is already freeing it.
+	if ((e->env_status == ENV_DYING && curenv != e) ||
+	    e->env_status == ENV_FREE) {
+		spin_unlock(&env_table_lock);
+		return;
+	}
 
-	if (curenv == e) {
-		curenv = NULL;
+	// Keep the scheduler away from e while we tear it down.
+	// Takes e off its run queue or wait queue
+	sched_set_status(e, ENV_DYING);
+	spin_unlock(&env_table_lock);
+
+	self = (curenv == e);
+	env_reap_later(e);
+	if (self)
 		sched_yield();
-	}
 }
 
 
@@ -512,12 +820,10 @@ env_destroy(struct Env *e)
 void
 env_pop_tf(struct Trapframe *tf)
 {
-	// Record the CPU we are running on for user-space debugging
-	curenv->env_cpunum = cpunum();
-
 	asm volatile(
 		"\tmovl %0,%%esp\n"
 		"\tpopal\n"
+		"\tpopl %%gs\n"
 		"\tpopl %%es\n"
 		"\tpopl %%ds\n"
 		"\taddl $0x8,%%esp\n" /* skip tf_trapno and tf_errcode */
@@ -529,6 +835,8 @@ env_pop_tf(struct Trapframe *tf)
 //
 // Context switch from curenv to env e.
 // Note: if this is the first call to env_run, curenv is NULL.
+// The caller must hold env_table_lock, which is released once e's
+// status has been updated.
 //
 // This function does not return.
 //
@@ -554,20 +862,23 @@ env_run(struct Env *e)
 
 	// LAB 3: Your code here.
 
-	if (curenv != NULL)
+	if (curenv != NULL && curenv != e)
 	{
 		if (curenv->env_status == ENV_RUNNING)
 		{
-			curenv->env_status = ENV_RUNNABLE;
+			sched_set_status(curenv, ENV_RUNNABLE);
 		}
 		// we have saved context of curenv at _alltrap
 	}
+	fpu_switch(e);
 	curenv = e;
 	e->env_status = ENV_RUNNING;
 	e->env_runs++;
+	// Record the CPU we are running on for user-space debugging
+	e->env_cpunum = cpunum();
 	lcr3(PADDR(e->env_pgdir));
 
-	unlock_kernel();
+	spin_unlock(&env_table_lock);
 
 	env_pop_tf(&e->env_tf);
 
@@ -7,6 +7,9 @@
 #include <kern/cpu.h>
 
 extern struct Env *envs;		// All environments
+extern struct waitqueue env_exit_wq;	// Waiters for an env to be freed,
+					// keyed by its envid
+extern struct kthread *env_reaper;	// Kernel thread freeing dying envs
 #define curenv (thiscpu->cpu_env)		// Current environment
 extern struct Segdesc gdt[];
 
@@ -15,10 +18,22 @@ void	env_init_percpu(void);
 int	env_alloc(struct Env **e, envid_t parent_id);
 void	env_free(struct Env *e);
 void	env_create(uint8_t *binary, enum EnvType type);
+int	env_load_elf(struct Env *e, const uint8_t *binary, size_t len,
+		     struct Env *src, uintptr_t *entry_store);
 void	env_destroy(struct Env *e);	// Does not return if e == curenv
+void	env_reap_later(struct Env *e);
+int	env_reap(int n);
+bool	env_reap_pending(void);
+
+// Dying envs the reaper frees before it yields
+#define ENV_REAP_BATCH	8
 
 int	envid2env(envid_t envid, struct Env **env_store, bool checkperm);
-// The following two functions do not return
+int	envid2env_lock(envid_t envid, struct Env **env_store, bool checkperm);
+void	lock_env(struct Env *e);
+void	unlock_env(struct Env *e);
+// The following two functions do not return.
+// env_run must be called with env_table_lock held and releases it.
 void	env_run(struct Env *e) __attribute__((noreturn));
 void	env_pop_tf(struct Trapframe *tf) __attribute__((noreturn));
 
@@ -0,0 +1,144 @@
+// Lazy FPU/SSE context switching.
+//
+// Most envs never touch the FPU, so its state is not switched along
+// with the other registers.  Instead env_run() sets CR0.TS unless the
+// FPU registers already hold the next env's state, and the env's first
+// x87 or SSE instruction then raises #NM (T_DEVICE), where fpu_trap()
+// loads its state.  An env that has used the FPU has its state saved
+// when it is switched out, but the registers keep a copy, so an env
+// that has a CPU's FPU to itself takes no further #NM.
+//
+// The kernel itself never uses the FPU (it is built with -mno-sse).
+
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/assert.h>
+#include <inc/string.h>
+#include <kern/cpu.h>
+#include <kern/env.h>
+#include <kern/fpu.h>
+
+#define CPUID_FXSR	(1 << 24)	// CPUID.1:EDX, FXSAVE and FXRSTOR
+#define MXCSR_DEFAULT	0x1f80		// all SIMD exceptions masked
+
+struct fpu_state {
+	uint8_t fs_fxsave[512];		// FXSAVE image
+	int fs_cpu;			// CPU whose registers also hold this
+					// state, or -1
+	bool fs_used;			// Has the env used the FPU yet?
+} __attribute__((aligned(16)));
+
+// FPU state of each env, indexed like envs[].  Kept out of struct Env
+// since that is also mapped to users.
+static struct fpu_state env_fpu[NENV];
+
+static struct fpu_state *
+env_fpu_state(envid_t envid)
+{
+	return &env_fpu[ENVX(envid)];
+}
+
+// Enable FXSAVE and SSE on this CPU and leave the FPU unowned.
+void
+fpu_init(void)
+{
+	uint32_t edx;
+
+	cpuid(1, NULL, NULL, NULL, &edx);
+	if (!(edx & CPUID_FXSR))
+		panic("fpu_init: CPU lacks FXSAVE/FXRSTOR");
+
+	lcr4(rcr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+	lcr0((rcr0() | CR0_MP | CR0_NE | CR0_TS) & ~CR0_EM);
+	thiscpu->cpu_fpu_owner = 0;
+	thiscpu->cpu_fpu_dirty = false;
+}
+
+// Give a new env a clean FPU, set up on its first use.
+void
+fpu_env_init(struct Env *e)
+{
+	struct fpu_state *st = env_fpu_state(e->env_id);
+
+	st->fs_used = false;
+	st->fs_cpu = -1;
+}
+
+// Copy curenv's FPU state to its new child.
+void
+fpu_fork(struct Env *child)
+{
+	struct fpu_state *st = env_fpu_state(curenv->env_id);
+	struct fpu_state *cst = env_fpu_state(child->env_id);
+
+	if (!st->fs_used)
+		return;
+	if (thiscpu->cpu_fpu_dirty && thiscpu->cpu_fpu_owner == curenv->env_id)
+		asm volatile("fxsave %0" : "=m" (st->fs_fxsave));
+	memcpy(cst->fs_fxsave, st->fs_fxsave, sizeof(cst->fs_fxsave));
+	cst->fs_used = true;
+	cst->fs_cpu = -1;
+}
+
+// e is dying: its FPU state need not be saved any more.  Called on the
+// CPU that last ran e.
+void
+fpu_env_free(struct Env *e)
+{
+	if (thiscpu->cpu_fpu_owner == e->env_id) {
+		thiscpu->cpu_fpu_owner = 0;
+		thiscpu->cpu_fpu_dirty = false;
+	}
+}
+
+// Called by env_run() before switching this CPU to env 'next', or with
+// NULL when the CPU goes idle.  Saves the state of the env that used
+// the FPU here, if it changed, and sets CR0.TS unless the registers
+// already hold next's state.
+void
+fpu_switch(struct Env *next)
+{
+	struct CpuInfo *c = thiscpu;
+	bool owned;
+	uint32_t cr0;
+
+	owned = next && c->cpu_fpu_owner == next->env_id &&
+		env_fpu_state(next->env_id)->fs_cpu == c - cpus;
+	if (c->cpu_fpu_dirty && !owned) {
+		asm volatile("fxsave %0"
+			     : "=m" (env_fpu_state(c->cpu_fpu_owner)->fs_fxsave));
+		c->cpu_fpu_dirty = false;
+	}
+
+	// Writing CR0 is slow, so only do it when TS has to change
+	cr0 = rcr0();
+	if (owned && (cr0 & CR0_TS))
+		asm volatile("clts");
+	else if (!owned && !(cr0 & CR0_TS))
+		lcr0(cr0 | CR0_TS);
+}
+
+// #NM from user mode: curenv wants the FPU.  Load its state, or a
+// clean FPU if it has never used one.
+void
+fpu_trap(void)
+{
+	struct CpuInfo *c = thiscpu;
+	struct fpu_state *st = env_fpu_state(curenv->env_id);
+	uint32_t mxcsr = MXCSR_DEFAULT;
+
+	asm volatile("clts");
+	if (c->cpu_fpu_owner != curenv->env_id || st->fs_cpu != c - cpus) {
+		// Whoever owned the FPU here was saved when switched out
+		assert(!c->cpu_fpu_dirty);
+		if (st->fs_used)
+			asm volatile("fxrstor %0" : : "m" (st->fs_fxsave));
+		else {
+			asm volatile("fninit; ldmxcsr %0" : : "m" (mxcsr));
+			st->fs_used = true;
+		}
+		c->cpu_fpu_owner = curenv->env_id;
+		st->fs_cpu = c - cpus;
+	}
+	c->cpu_fpu_dirty = true;
+}
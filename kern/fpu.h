@@ -0,0 +1,16 @@
+#ifndef JOS_KERN_FPU_H
+#define JOS_KERN_FPU_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+struct Env;
+
+void fpu_init(void);
+void fpu_env_init(struct Env *e);
+void fpu_fork(struct Env *child);
+void fpu_env_free(struct Env *e);
+void fpu_switch(struct Env *next);
+void fpu_trap(void);
+
+#endif	// !JOS_KERN_FPU_H
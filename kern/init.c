@@ -14,6 +14,9 @@
 #include <kern/picirq.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/time.h>
+#include <kern/ring.h>
+#include <kern/shlib.h>
 
 static void boot_aps(void);
 
@@ -21,6 +24,10 @@ static void boot_aps(void);
 void
 i386_init(void)
 {
+	// Find this CPU's struct CpuInfo through %gs.  Until mp_init()
+	// says otherwise, we are CPU 0.
+	percpu_init(0);
+
 	// Initialize the console.
 	// Can't call cprintf until after we do this!
 	cons_init();
@@ -40,6 +47,8 @@ i386_init(void)
 
 	// Lab 3 user environment initialization functions
 	env_init();
+	shlib_init();
+	ring_init();
 	trap_init();
 
 	// Lab 4 multiprocessor initialization functions
@@ -48,13 +57,7 @@ i386_init(void)
 
 	// Lab 4 multitasking initialization functions
 	pic_init();
-
-	// Acquire the big kernel lock before waking up APs
-	// Your code here:
-	lock_kernel();
-
-	// Starting non-boot CPUs
-	boot_aps();
+	time_init();
 
 	// Start fs.
 	ENV_CREATE(fs_fs, ENV_TYPE_FS);
@@ -67,6 +70,18 @@ i386_init(void)
 	ENV_CREATE(user_icode, ENV_TYPE_USER);
 #endif // TEST*
 
+	// Starting non-boot CPUs.  There is no big kernel lock to hold
+	// them back, so create the initial environments first; otherwise
+	// an AP could find nothing to run and drop into the monitor.
+	boot_aps();
+
+#ifdef BENCH_SPINLOCK
+	spinlock_bench();
+#endif
+#ifdef BENCH_LAYOUT
+	layout_bench();
+#endif
+
 	// Should not be necessary - drains keyboard because interrupt has given up.
 	kbd_intr();
 
@@ -112,6 +127,7 @@ mp_main(void)
 {
 	// We are in high EIP now, safe to switch to kern_pgdir 
 	lcr3(PADDR(kern_pgdir));
+	percpu_init(lapic_id());
 	cprintf("SMP: CPU %d starting\n", cpunum());
 
 	lapic_init();
@@ -119,12 +135,16 @@ mp_main(void)
 	trap_init_percpu();
 	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
 
+#ifdef BENCH_SPINLOCK
+	spinlock_bench();
+#endif
+#ifdef BENCH_LAYOUT
+	layout_bench();
+#endif
+
 	// Now that we have finished some basic setup, call sched_yield()
-	// to start running processes on this CPU.  But make sure that
-	// only one CPU can enter the scheduler at a time!
-	//
-	// Your code here:
-	lock_kernel();
+	// to start running processes on this CPU.  The scheduler takes
+	// env_table_lock itself.
 	sched_yield();
 
 	// Remove this after you finish Exercise 6
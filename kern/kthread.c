@@ -0,0 +1,277 @@
+// Kernel threads.
+//
+// A kernel thread is scheduled by sched_run() like an env, but runs in
+// the kernel on a stack of its own, so kernel subsystems can hand long
+// or deferrable work to one instead of doing it on a syscall or
+// interrupt path.  Switching to a thread and back only saves the
+// callee-saved registers (kern/switch.S).
+//
+// A thread gives up the CPU with env_table_lock held, saves its
+// context and then moves to the CPU's kernel stack to run the
+// scheduler; whoever resumes it releases the lock on its behalf.  So
+// no other CPU can pick a thread up before its context is saved.
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/x86.h>
+#include <kern/kthread.h>
+#include <kern/spinlock.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/sched.h>
+#include <kern/fpu.h>
+
+void kthread_save(uintptr_t *esp_store, uintptr_t stack,
+		  void (*then)(void *), void *arg);
+void kthread_load(uintptr_t esp) __attribute__((noreturn));
+
+static struct kthread kthreads[NKTHREAD];
+
+// Run queues of RUNNABLE threads, one per priority.  Kernel threads are
+// few, so they are shared by all CPUs.
+static struct kthread *kthread_runq_head[KTHREAD_NPRIO];
+static struct kthread *kthread_runq_tail[KTHREAD_NPRIO];
+
+// Queue kt, kicking a halted CPU to run it.
+static void
+kthread_enqueue(struct kthread *kt)
+{
+	int i;
+
+	kt->kt_next = NULL;
+	if (kthread_runq_tail[kt->kt_prio])
+		kthread_runq_tail[kt->kt_prio]->kt_next = kt;
+	else
+		kthread_runq_head[kt->kt_prio] = kt;
+	kthread_runq_tail[kt->kt_prio] = kt;
+
+	for (i = 0; i < ncpu; i++)
+		if (&cpus[i] != thiscpu && cpus[i].cpu_status == CPU_HALTED) {
+			lapic_ipi_cpu(cpus[i].cpu_id, IRQ_OFFSET + IRQ_RESCHED);
+			break;
+		}
+}
+
+static void
+kthread_dequeue(struct kthread *kt)
+{
+	struct kthread **pp, *prev = NULL;
+
+	for (pp = &kthread_runq_head[kt->kt_prio]; *pp; prev = *pp, pp = &(*pp)->kt_next)
+		if (*pp == kt) {
+			*pp = kt->kt_next;
+			if (kthread_runq_tail[kt->kt_prio] == kt)
+				kthread_runq_tail[kt->kt_prio] = prev;
+			break;
+		}
+	kt->kt_next = NULL;
+}
+
+// First code a new thread runs, returned to by kthread_load().
+static void
+kthread_start(struct kthread *kt)
+{
+	spin_unlock(&env_table_lock);
+	kt->kt_func(kt->kt_arg);
+	kthread_exit();
+}
+
+//
+// Create a kernel thread that calls func(arg) at priority 'prio'.  It
+// exits when func returns.
+//
+// RETURNS
+//   0 on success, < 0 on failure.  Errors include:
+//	-E_NO_FREE_ENV if all NKTHREAD threads are in use
+//	-E_NO_MEM on memory exhaustion
+//
+int
+kthread_create(struct kthread **kt_store, const char *name,
+	       void (*func)(void *), void *arg, int prio)
+{
+	struct kthread *kt;
+	struct PageInfo *pp;
+	uintptr_t *sp;
+
+	assert(prio >= 0 && prio < KTHREAD_NPRIO);
+	if (!(pp = page_alloc(0)))
+		return -E_NO_MEM;
+	page_incref(pp);
+
+	spin_lock(&env_table_lock);
+	for (kt = kthreads; kt < kthreads + NKTHREAD; kt++)
+		if (kt->kt_status == KT_FREE)
+			break;
+	if (kt == kthreads + NKTHREAD) {
+		spin_unlock(&env_table_lock);
+		page_decref(pp);
+		return -E_NO_FREE_ENV;
+	}
+
+	kt->kt_name = name;
+	kt->kt_prio = prio;
+	kt->kt_wakeup = false;
+	kt->kt_stack = pp;
+	kt->kt_func = func;
+	kt->kt_arg = arg;
+
+	// Lay out the stack as kthread_save() would, so that
+	// kthread_load() "returns" into kthread_start(kt).
+	sp = (uintptr_t *) ((uintptr_t) page2kva(pp) + KTHREAD_STKSIZE);
+	*--sp = (uintptr_t) kt;
+	*--sp = 0;			// kthread_start() does not return
+	*--sp = (uintptr_t) kthread_start;
+	*--sp = 0;			// %ebp
+	*--sp = 0;			// %ebx
+	*--sp = 0;			// %esi
+	*--sp = 0;			// %edi
+	kt->kt_esp = (uintptr_t) sp;
+
+	kt->kt_status = KT_RUNNABLE;
+	kthread_enqueue(kt);
+	spin_unlock(&env_table_lock);
+
+	if (kt_store)
+		*kt_store = kt;
+	return 0;
+}
+
+// Called on the CPU's kernel stack once kt has been switched out.
+// Called with env_table_lock held.
+static void
+kthread_park(void *arg)
+{
+	struct kthread *kt = arg;
+
+	curkthread = NULL;
+	if (kt->kt_status == KT_RUNNABLE)
+		kthread_enqueue(kt);
+	else if (kt->kt_status == KT_DEAD) {
+		page_decref(kt->kt_stack);
+		kt->kt_stack = NULL;
+		kt->kt_status = KT_FREE;
+	}
+	sched_run();
+}
+
+// Switch out of the current thread, whose new status has been set, and
+// run the scheduler.  Called with env_table_lock held; returns, with it
+// still held, once the thread is resumed.
+static void
+kthread_switch(void)
+{
+	struct kthread *kt = curkthread;
+
+	kthread_save(&kt->kt_esp, thiscpu->cpu_ts.ts_esp0, kthread_park, kt);
+}
+
+// Let other threads and envs run, and come back later.
+void
+kthread_yield(void)
+{
+	spin_lock(&env_table_lock);
+	curkthread->kt_status = KT_RUNNABLE;
+	kthread_switch();
+	spin_unlock(&env_table_lock);
+}
+
+// Sleep until kthread_wakeup(), unless it has been called since the
+// current thread last slept.  Callers check for their work after
+// waking, so a wakeup that comes in before they sleep is not lost.
+void
+kthread_sleep(void)
+{
+	struct kthread *kt = curkthread;
+
+	spin_lock(&env_table_lock);
+	if (!kt->kt_wakeup) {
+		kt->kt_status = KT_SLEEPING;
+		kthread_switch();
+	}
+	kt->kt_wakeup = false;
+	spin_unlock(&env_table_lock);
+}
+
+// Called with env_table_lock held.
+void
+kthread_wakeup(struct kthread *kt)
+{
+	kt->kt_wakeup = true;
+	if (kt->kt_status == KT_SLEEPING) {
+		kt->kt_status = KT_RUNNABLE;
+		kthread_enqueue(kt);
+	}
+}
+
+// The current thread is done.  Its stack is freed once it is off it.
+void
+kthread_exit(void)
+{
+	spin_lock(&env_table_lock);
+	curkthread->kt_status = KT_DEAD;
+	kthread_switch();
+	panic("kthread_exit: dead thread resumed");
+}
+
+// Called with env_table_lock held.
+void
+kthread_set_prio(struct kthread *kt, int prio)
+{
+	assert(prio >= 0 && prio < KTHREAD_NPRIO);
+	if (kt->kt_prio == prio)
+		return;
+	if (kt->kt_status == KT_RUNNABLE) {
+		kthread_dequeue(kt);
+		kt->kt_prio = prio;
+		kthread_enqueue(kt);
+	} else
+		kt->kt_prio = prio;
+}
+
+// Take the next RUNNABLE thread of priority 'prio', or NULL.
+// Called with env_table_lock held.
+struct kthread *
+kthread_next(int prio)
+{
+	struct kthread *kt = kthread_runq_head[prio];
+
+	if (kt) {
+		kthread_runq_head[prio] = kt->kt_next;
+		if (!kthread_runq_head[prio])
+			kthread_runq_tail[prio] = NULL;
+		kt->kt_next = NULL;
+	}
+	return kt;
+}
+
+// Switch this CPU to kt, taken off a run queue by kthread_next().  A
+// thread runs in the kernel's address space with no env current, so
+// curenv, if still running, goes back on a run queue.  Called with
+// env_table_lock held, which kt releases.
+void
+kthread_run(struct kthread *kt)
+{
+	if (curenv) {
+		if (curenv->env_status == ENV_RUNNING)
+			sched_set_status(curenv, ENV_RUNNABLE);
+		fpu_switch(NULL);
+		curenv = NULL;
+		lcr3(PADDR(kern_pgdir));
+	}
+	kt->kt_status = KT_RUNNING;
+	curkthread = kt;
+	kthread_load(kt->kt_esp);
+}
+
+// Is any thread running or waiting to run?  Called with
+// env_table_lock held.
+bool
+kthread_busy(void)
+{
+	struct kthread *kt;
+
+	for (kt = kthreads; kt < kthreads + NKTHREAD; kt++)
+		if (kt->kt_status == KT_RUNNABLE || kt->kt_status == KT_RUNNING)
+			return true;
+	return false;
+}
@@ -0,0 +1,63 @@
+#ifndef JOS_KERN_KTHREAD_H
+#define JOS_KERN_KTHREAD_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <kern/cpu.h>
+
+#define NKTHREAD		16
+#define KTHREAD_STKSIZE		PGSIZE
+
+// Scheduling classes of kernel threads, relative to user envs.
+enum {
+	KTHREAD_PRIO_HIGH = 0,	// Runs ahead of every env
+	KTHREAD_PRIO_NORMAL,	// Takes turns with the envs of a CPU
+	KTHREAD_PRIO_IDLE,	// Runs only on a CPU that would otherwise halt
+	KTHREAD_NPRIO
+};
+
+// Values of kt_status
+enum {
+	KT_FREE = 0,
+	KT_RUNNABLE,
+	KT_RUNNING,
+	KT_SLEEPING,
+	KT_DEAD
+};
+
+// A kernel thread runs kt_func on its own stack, in the kernel's
+// address space, with interrupts off and no env current.  It is never
+// preempted: it runs until it calls kthread_yield(), kthread_sleep()
+// or kthread_exit(), so long jobs should yield between pieces.  Kernel
+// threads are protected by env_table_lock.
+struct kthread {
+	const char *kt_name;
+	unsigned kt_status;
+	int kt_prio;			// KTHREAD_PRIO_*
+	bool kt_wakeup;			// kthread_wakeup() since the last sleep
+	uintptr_t kt_esp;		// Saved stack pointer when switched out
+	struct PageInfo *kt_stack;
+	struct kthread *kt_next;	// Next on the run queue
+	void (*kt_func)(void *arg);
+	void *kt_arg;
+};
+
+// The kernel thread running on this CPU, or NULL.
+#define curkthread (thiscpu->cpu_kthread)
+
+int kthread_create(struct kthread **kt_store, const char *name,
+		   void (*func)(void *), void *arg, int prio);
+void kthread_yield(void);
+void kthread_sleep(void);
+void kthread_exit(void) __attribute__((noreturn));
+void kthread_wakeup(struct kthread *kt);
+void kthread_set_prio(struct kthread *kt, int prio);
+
+// Used by the scheduler, with env_table_lock held.
+struct kthread *kthread_next(int prio);
+void kthread_run(struct kthread *kt) __attribute__((noreturn));
+bool kthread_busy(void);
+
+#endif	// !JOS_KERN_KTHREAD_H
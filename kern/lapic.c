@@ -111,8 +111,10 @@ lapic_init(void)
 	lapicw(TPR, 0);
 }
 
+// Read this CPU's LAPIC ID from the hardware.  Only needed to find out
+// which CPU we are before percpu_init(); use cpunum() afterwards.
 int
-cpunum(void)
+lapic_id(void)
 {
 	if (lapic)
 		return lapic[ID] >> 24;
@@ -180,3 +182,13 @@ lapic_ipi(int vector)
 	while (lapic[ICRLO] & DELIVS)
 		;
 }
+
+// Send interrupt 'vector' to the CPU with local APIC ID 'apicid'.
+void
+lapic_ipi_cpu(int apicid, int vector)
+{
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
@@ -0,0 +1,210 @@
+// Multiprocessor microbenchmarks.
+//
+// Spinlock contention: every CPU hammers one lock of each type for a
+// fixed number of TSC cycles, timing each acquisition.  The boot CPU
+// then reports the mean and worst acquire latency and how evenly the
+// acquisitions were spread over the CPUs.  Build with -DBENCH_SPINLOCK
+// and run with e.g.
+//	make qemu-nox CPUS=8 INIT_CFLAGS=-DBENCH_SPINLOCK
+//
+// False sharing: every CPU xchg()s a status word of its own, first in
+// a packed array where neighbouring CPUs' words share cache lines, then
+// in its cache-line aligned struct CpuInfo and struct Env.  Build with
+// -DBENCH_LAYOUT.
+
+#include <inc/types.h>
+#include <inc/stdio.h>
+#include <inc/assert.h>
+#include <inc/x86.h>
+#include <kern/cpu.h>
+#include <kern/env.h>
+#include <kern/spinlock.h>
+
+#define BENCH_CYCLES	200000000ULL	// length of one run, in TSC cycles
+#define BENCH_CS_WORK	50		// iterations of work inside the lock
+#define BENCH_NCS_WORK	200		// iterations of work outside the lock
+#define LAYOUT_ITERS	1000000		// xchg()s per CPU per layout run
+
+static const char * const bench_names[] = {
+	[SPINLOCK_TAS] = "tas",
+	[SPINLOCK_TICKET] = "ticket",
+	[SPINLOCK_MCS] = "mcs",
+};
+
+static struct spinlock bench_lock;
+static volatile uint32_t bench_counter;
+static volatile uint64_t bench_deadline;
+
+// Per-CPU results, padded so CPUs don't share a line while counting.
+static struct {
+	uint64_t acquires;
+	uint64_t wait_total;
+	uint64_t wait_max;
+} __attribute__((aligned(64))) bench_stats[NCPU];
+
+// Sense-reversing barrier over all ncpu CPUs.
+static volatile uint32_t barrier_count;
+static volatile uint32_t barrier_sense;
+
+static void
+bench_barrier(void)
+{
+	uint32_t sense = !barrier_sense;
+
+	if (xadd(&barrier_count, 1) == ncpu - 1) {
+		barrier_count = 0;
+		xchg(&barrier_sense, sense);
+	} else {
+		while (barrier_sense != sense)
+			asm volatile("pause");
+	}
+}
+
+static void
+bench_work(int n)
+{
+	volatile int i;
+
+	for (i = 0; i < n; i++)
+		;
+}
+
+static void
+bench_run(int type)
+{
+	int me = cpunum();
+	uint64_t t0, t1;
+
+	if (thiscpu == bootcpu) {
+		__spin_initlock(&bench_lock, "bench_lock", LOCK_RANK_NONE, type);
+		bench_counter = 0;
+	}
+	bench_stats[me].acquires = 0;
+	bench_stats[me].wait_total = 0;
+	bench_stats[me].wait_max = 0;
+	bench_barrier();
+
+	if (thiscpu == bootcpu)
+		bench_deadline = read_tsc() + BENCH_CYCLES;
+	bench_barrier();
+
+	while ((t0 = read_tsc()) < bench_deadline) {
+		spin_lock(&bench_lock);
+		t1 = read_tsc();
+		bench_counter++;
+		bench_work(BENCH_CS_WORK);
+		spin_unlock(&bench_lock);
+
+		bench_stats[me].acquires++;
+		bench_stats[me].wait_total += t1 - t0;
+		if (t1 - t0 > bench_stats[me].wait_max)
+			bench_stats[me].wait_max = t1 - t0;
+		bench_work(BENCH_NCS_WORK);
+	}
+	bench_barrier();
+}
+
+static void
+bench_report(int type)
+{
+	uint64_t total = 0, wait = 0, wmax = 0, amin = ~0ULL, amax = 0;
+	int i;
+
+	for (i = 0; i < ncpu; i++) {
+		total += bench_stats[i].acquires;
+		wait += bench_stats[i].wait_total;
+		if (bench_stats[i].wait_max > wmax)
+			wmax = bench_stats[i].wait_max;
+		if (bench_stats[i].acquires < amin)
+			amin = bench_stats[i].acquires;
+		if (bench_stats[i].acquires > amax)
+			amax = bench_stats[i].acquires;
+	}
+	if (bench_counter != total)
+		panic("spinlock bench: %s lost updates (%u != %llu)",
+		      bench_names[type], bench_counter, total);
+
+	cprintf("  %-6s %10llu acquires  wait avg %8llu max %10llu cycles"
+		"  per-CPU min %llu max %llu\n", bench_names[type], total,
+		total ? wait / total : 0, wmax, amin, amax);
+}
+
+// Called by every CPU once all CPUs are up; returns on all of them
+// after the run.
+void
+spinlock_bench(void)
+{
+	int type;
+
+	if (thiscpu == bootcpu)
+		cprintf("spinlock bench: %d CPUs, %llu cycles per lock type\n",
+			ncpu, BENCH_CYCLES);
+	for (type = SPINLOCK_TAS; type <= SPINLOCK_MCS; type++) {
+		bench_run(type);
+		if (thiscpu == bootcpu)
+			bench_report(type);
+		bench_barrier();
+	}
+}
+
+// Status words of all CPUs packed together, as they were laid out
+// before struct CpuInfo and struct Env were cache-line aligned.
+static volatile uint32_t layout_packed[NCPU];
+
+// Time LAYOUT_ITERS xchg()s on 'word' on every CPU at once.
+static void
+layout_run(volatile uint32_t *word)
+{
+	int me = cpunum();
+	uint32_t val = *word;
+	uint64_t t0;
+	int i;
+
+	bench_barrier();
+	t0 = read_tsc();
+	for (i = 0; i < LAYOUT_ITERS; i++)
+		xchg(word, val);
+	bench_stats[me].wait_total = read_tsc() - t0;
+	bench_barrier();
+}
+
+static void
+layout_report(const char *name)
+{
+	uint64_t total = 0;
+	int i;
+
+	for (i = 0; i < ncpu; i++)
+		total += bench_stats[i].wait_total;
+	cprintf("  %-12s %6llu cycles per xchg\n", name,
+		total / ((uint64_t) ncpu * LAYOUT_ITERS));
+}
+
+// Called by every CPU once all CPUs are up; returns on all of them
+// after the run.
+void
+layout_bench(void)
+{
+	int me = cpunum();
+
+	if (thiscpu == bootcpu)
+		cprintf("layout bench: %d CPUs, %d xchgs per CPU\n",
+			ncpu, LAYOUT_ITERS);
+
+	layout_run(&layout_packed[me]);
+	if (thiscpu == bootcpu)
+		layout_report("packed");
+	bench_barrier();
+
+	layout_run(&thiscpu->cpu_status);
+	if (thiscpu == bootcpu)
+		layout_report("cpu_status");
+	bench_barrier();
+
+	// Free envs from the end of envs[], which nothing else touches
+	// while the benchmark runs
+	layout_run((volatile uint32_t *) &envs[NENV - 1 - me].env_status);
+	if (thiscpu == bootcpu)
+		layout_report("env_status");
+	bench_barrier();
+}
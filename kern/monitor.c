@@ -11,6 +11,7 @@
 #include <kern/monitor.h>
 #include <kern/kdebug.h>
 #include <kern/trap.h>
+#include <kern/spinlock.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -28,6 +29,7 @@ static struct Command commands[] = {
 	{ "backtrace", "Display backtrace of the stack", mon_backtrace},
 	{ "continue", "Continue execution of current environment", mon_continue },
 	{ "si", "single step", mon_si},
+	{ "lockstat", "Show lock contention statistics ('lockstat reset' clears them)", mon_lockstat },
 };
 
 /***** Implementations of basic kernel monitor commands *****/
@@ -102,6 +104,17 @@ mon_si(int argc, char **argv, struct Trapframe *tf)
 	return -1;
 }
 
+int
+mon_lockstat(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc > 2 || (argc == 2 && strcmp(argv[1], "reset") != 0)) {
+		cprintf("Usage: lockstat [reset]\n");
+		return 0;
+	}
+	spin_stats_dump(argc == 2);
+	return 0;
+}
+
 /***** Kernel monitor command interpreter *****/
 
 #define WHITESPACE "\t\r\n "
@@ -10,6 +10,8 @@
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/region.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;			// Amount of physical memory (in pages)
@@ -19,6 +21,12 @@ static size_t npages_basemem;	// Amount of base memory (in pages)
 pde_t *kern_pgdir;		// Kernel's initial page directory
 struct PageInfo *pages;		// Physical page state array
 static struct PageInfo *page_free_list;	// Free list of physical pages
+struct UStats *ustats;		// Time and scheduler statistics
+
+// Protects page_free_list.  pp_ref counts are updated atomically
+// instead (see page_incref), and page tables are protected by the
+// lock of the env that owns them.
+struct spinlock page_lock = SPINLOCK_INITIALIZER("page_lock", LOCK_RANK_PAGE, SPINLOCK_TICKET);
 
 
 // --------------------------------------------------------------
@@ -183,6 +191,13 @@ mem_init(void)
 	// LAB 3: Your code here.
 	envs = (struct Env *) boot_alloc(sizeof(struct Env) * NENV);
 
+	//////////////////////////////////////////////////////////////////////
+	// Allocate the statistics page that is mapped at USTATS.
+	ustats = (struct UStats *) boot_alloc(PGSIZE);
+	memset(ustats, 0, PGSIZE);
+	static_assert(sizeof(struct UStats) <= PGSIZE);
+	static_assert(NCPU <= USTATS_NCPU);
+
 	//////////////////////////////////////////////////////////////////////
 	// Now that we've allocated the initial kernel data structures, we set
 	// up the list of free physical pages. Once we've done so, all further
@@ -218,7 +233,16 @@ mem_init(void)
 	//    - the new image at UENVS  -- kernel R, user R
 	//    - envs itself -- kernel RW, user NONE
 	// LAB 3: Your code here.
-	boot_map_region(kern_pgdir, UENVS, PTSIZE, PADDR(envs), PTE_U | PTE_P);
+	n = ROUNDUP(sizeof(struct Env) * NENV, PGSIZE);
+	assert(UENVS + n <= USTATS);
+	boot_map_region(kern_pgdir, UENVS, n, PADDR(envs), PTE_U | PTE_P);
+
+	//////////////////////////////////////////////////////////////////////
+	// Map the statistics page read-only by the user at USTATS.
+	// Permissions:
+	//    - the new image at USTATS -- kernel R, user R
+	//    - ustats itself -- kernel RW, user NONE
+	boot_map_region(kern_pgdir, USTATS, PGSIZE, PADDR(ustats), PTE_U | PTE_P);
 
 	//////////////////////////////////////////////////////////////////////
 	// Use the physical memory that 'bootstack' refers to as the kernel
@@ -354,7 +378,7 @@ page_init(void)
 
 		if (i >= IOPHYSMEM / PGSIZE && i < EXTPHYSMEM / PGSIZE)
 			continue;
-		if (i >= EXTPHYSMEM / PGSIZE && (uintptr_t)KADDR(i * PGSIZE) < (uintptr_t)(envs + NENV))
+		if (i >= EXTPHYSMEM / PGSIZE && (uintptr_t)KADDR(i * PGSIZE) < (uintptr_t)boot_alloc(0))
 			continue;
 		pages[i].pp_ref = 0;
 		pages[i].pp_link = page_free_list;
@@ -378,10 +402,14 @@ struct PageInfo *
 page_alloc(int alloc_flags)
 {
 	// Fill this function in
-	if (page_free_list == NULL)
+	spin_lock(&page_lock);
+	if (page_free_list == NULL) {
+		spin_unlock(&page_lock);
 		return NULL;
+	}
 	struct PageInfo * result = page_free_list;
 	page_free_list = result->pp_link;
+	spin_unlock(&page_lock);
 	result->pp_link = NULL;
 	if (alloc_flags & ALLOC_ZERO)
 		memset(page2kva(result), '\0', PGSIZE);
@@ -402,8 +430,10 @@ page_free(struct PageInfo *pp)
 		panic("nonzero pp->pp_ref in page_free()");
 	if (pp->pp_link != NULL)
 		panic("double-free!!");
+	spin_lock(&page_lock);
 	pp->pp_link = page_free_list;
 	page_free_list = pp;
+	spin_unlock(&page_lock);
 }
 
 //
@@ -413,7 +443,12 @@ page_free(struct PageInfo *pp)
 void
 page_decref(struct PageInfo* pp)
 {
-	if (--pp->pp_ref == 0)
+	uint8_t zero;
+
+	// The page may be mapped by envs on other CPUs as well
+	asm volatile("lock; decw %0; sete %1"
+		     : "+m" (pp->pp_ref), "=q" (zero) : : "cc");
+	if (zero)
 		page_free(pp);
 }
 
@@ -456,7 +491,7 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 		{
 			return NULL; // allocation fails
 		}
-		pgtablePage->pp_ref++;
+		page_incref(pgtablePage);
 
 		// insert the new page table into the page directory
 		pgdir[pdx] = page2pa(pgtablePage) | PTE_P | PTE_U | PTE_W;
@@ -545,7 +580,7 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 	{
 		return -E_NO_MEM;
 	}
-	pp->pp_ref++; // increase ref before removing to address the corner case
+	page_incref(pp); // increase ref before removing to address the corner case
 	page_remove(pgdir, va);
 	*pte = page2pa(pp) | perm | PTE_P;
 	return 0;
@@ -608,6 +643,100 @@ page_remove(pde_t *pgdir, void *va)
 	page_decref(pg);
 }
 
+//
+// Give pgdir a private, writable copy of the copy-on-write page mapped
+// at 'va'.  If no one else maps the page any more, its mapping is just
+// made writable.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL, if no user page is mapped copy-on-write at va
+//   -E_NO_MEM, if there is no memory for the copy
+//
+// The caller must hold the lock of the env that owns pgdir.
+//
+int
+page_cow_break(pde_t *pgdir, void *va)
+{
+	struct PageInfo *pp, *np;
+	pte_t *pte;
+	int perm;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	pp = page_lookup(pgdir, va, &pte);
+	if (!pp || (*pte & (PTE_U | PTE_COW)) != (PTE_U | PTE_COW))
+		return -E_INVAL;
+	perm = (*pte & PTE_SYSCALL & ~PTE_COW) | PTE_W;
+
+	// Every other mapping holds a reference, and no new one can be
+	// made while we hold the lock, so the page is ours alone
+	if (pp->pp_ref == 1) {
+		*pte = page2pa(pp) | perm;
+		tlb_invalidate(pgdir, va);
+		return 0;
+	}
+
+	if (!(np = page_alloc(0)))
+		return -E_NO_MEM;
+	memcpy(page2kva(np), page2kva(pp), PGSIZE);
+	// The page table is there already, so this cannot fail
+	page_insert(pgdir, np, va, perm);
+	return 0;
+}
+
+//
+// Map every user page that src maps below 'limit' at the same address
+// in dst, for fork().  Pages that are writable or copy-on-write in src
+// become copy-on-write in both, except PTE_SHARE pages, which stay
+// shared as they are.  With 'share_only', only the PTE_SHARE pages are
+// mapped, as spawn() does.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if page tables for dst couldn't be allocated; dst then
+//	holds some of the mappings, and src may have been made
+//	copy-on-write
+//
+// The caller must hold the lock of the env that owns src, and dst must
+// not be in use yet.
+//
+int
+pgdir_copy(pde_t *dst, pde_t *src, uintptr_t limit, bool share_only)
+{
+	uintptr_t va;
+	pte_t *spt, *dpt, pte;
+	bool cow = false;
+	int i;
+
+	for (va = 0; va < limit; va += PTSIZE) {
+		if (!(src[PDX(va)] & PTE_P))
+			continue;
+		spt = KADDR(PTE_ADDR(src[PDX(va)]));
+		dpt = NULL;
+		for (i = 0; i < NPTENTRIES && va + i * PGSIZE < limit; i++) {
+			if (!((pte = spt[i]) & PTE_P) ||
+			    (share_only && !(pte & PTE_SHARE)))
+				continue;
+			if (!dpt && !(dpt = pgdir_walk(dst, (void *) va, 1)))
+				return -E_NO_MEM;
+			if (dpt[i] & PTE_P)
+				page_decref(pa2page(PTE_ADDR(dpt[i])));
+			if ((pte & (PTE_W | PTE_COW)) && !(pte & PTE_SHARE)) {
+				pte = (pte & ~PTE_W) | PTE_COW;
+				spt[i] = pte;
+				cow = true;
+			}
+			page_incref(pa2page(PTE_ADDR(pte)));
+			dpt[i] = PTE_ADDR(pte) | (pte & PTE_SYSCALL);
+		}
+	}
+
+	// Pages src could write before may still be writable in the TLB
+	if (cow && (!curenv || curenv->env_pgdir == src))
+		lcr3(PADDR(src));
+	return 0;
+}
+
 //
 // Invalidate a TLB entry, but only if the page tables being
 // edited are the ones currently in use by the processor.
@@ -690,7 +819,21 @@ static bool user_mem_check_page(struct Env *env, uintptr_t va, int perm)
 	pte_t *pte = pgdir_walk(env->env_pgdir, (void *)va, false);
 	if (pte == NULL || ~(*pte) & PTE_P)
 	{
-		return false; // PTE not present
+		// A demand-zero page is mapped as a user access would
+		lock_env(env);
+		bool mapped = region_fault(env, va) == 0;
+		unlock_env(env);
+		if (!mapped)
+			return false; // PTE not present
+		pte = pgdir_walk(env->env_pgdir, (void *)va, false);
+	}
+	// The kernel is about to write here: take env's own copy of a
+	// copy-on-write page, as a write fault would
+	if ((perm & PTE_W) && ((*pte) & (PTE_COW | PTE_W)) == PTE_COW)
+	{
+		lock_env(env);
+		page_cow_break(env->env_pgdir, (void *)va);
+		unlock_env(env);
 	}
 	return ((*pte) & perm) == perm;
 }
@@ -740,6 +883,96 @@ user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 	}
 }
 
+//
+// Is 'va' a page that env's pager (lib/pager.c) pages in, and that it
+// has yet to?  The pager describes what it pages in at UPAGERINFO, in
+// memory env may rewrite, so this reads it with care.
+//
+static bool
+user_mem_pageable(struct Env *env, uintptr_t va)
+{
+	struct PageInfo *pp;
+	struct PagerInfo *pi;
+	struct PagerSeg *ps;
+	pte_t *pte;
+	bool pageable = false;
+	int i;
+
+	if (va >= UTOP || !env->env_pgfault_upcall)
+		return false;
+	lock_env(env);
+	pte = pgdir_walk(env->env_pgdir, (void *) va, false);
+	if ((!pte || !(*pte & PTE_P)) &&
+	    (pp = page_lookup(env->env_pgdir, (void *) UPAGERINFO, NULL))) {
+		pi = (struct PagerInfo *) page2kva(pp);
+		for (i = 0; i < MIN(pi->pi_nseg, PAGER_NSEG); i++) {
+			ps = &pi->pi_seg[i];
+			if (va >= ROUNDDOWN(ps->ps_va, PGSIZE) &&
+			    va < MIN(ROUNDUP(ps->ps_fend, PGSIZE), ps->ps_end))
+				pageable = true;
+		}
+	}
+	unlock_env(env);
+	return pageable;
+}
+
+//
+// If 'va' is a page that env's pager has yet to page in, note it in
+// env->env_pagein_va, for the kernel to call env's page fault upcall
+// on before env goes on (see trap()), and return -E_PAGEIN.
+// Otherwise return 0.
+//
+int
+user_mem_pagein(struct Env *env, const void *va)
+{
+	if (!user_mem_pageable(env, (uintptr_t) va))
+		return 0;
+	env->env_pagein_va = ROUNDDOWN((uintptr_t) va, PGSIZE);
+	return -E_PAGEIN;
+}
+
+//
+// Like user_mem_check(), for memory env passes a system call.  The
+// pages of a program that spawn() loads lazily are only mapped once its
+// pager pages them in on a page fault, which the kernel's own accesses
+// do not cause.  So if the first page env cannot access is one that
+// the pager has yet to page in, have the pager called for it with
+// user_mem_pagein() and return -E_PAGEIN: the system call stubs
+// (lib/syscall.c) make the call again once it is paged in.
+//
+// Returns 0, -E_PAGEIN or -E_FAULT.
+//
+int
+user_arg_check(struct Env *env, const void *va, size_t len, int perm)
+{
+	uintptr_t a = (uintptr_t) va, end = a + len;
+
+	if (end < a)
+		return -E_FAULT;
+	while (user_mem_check_page(env, a, perm | PTE_U)) {
+		a = ROUNDDOWN(a, PGSIZE) + PGSIZE;
+		if (a >= end)
+			return 0;
+	}
+	if (user_mem_pagein(env, (void *) a) < 0)
+		return -E_PAGEIN;
+	return -E_FAULT;
+}
+
+//
+// Like user_mem_assert(), for memory env passes a system call: returns
+// 0, or -E_PAGEIN as user_arg_check() does, or destroys env.
+//
+int
+user_arg_assert(struct Env *env, const void *va, size_t len, int perm)
+{
+	int r;
+
+	if ((r = user_arg_check(env, va, len, perm)) == -E_FAULT)
+		user_mem_assert(env, va, len, perm);	// may not return
+	return r;
+}
+
 
 // --------------------------------------------------------------
 // Checking functions.
@@ -912,6 +1145,9 @@ check_kern_pgdir(void)
 	for (i = 0; i < n; i += PGSIZE)
 		assert(check_va2pa(pgdir, UENVS + i) == PADDR(envs) + i);
 
+	// check statistics page
+	assert(check_va2pa(pgdir, USTATS) == PADDR(ustats));
+
 	// check phys mem
 	for (i = 0; i < npages * PGSIZE; i += PGSIZE)
 		assert(check_va2pa(pgdir, KERNBASE + i) == i);
@@ -14,6 +14,7 @@ extern char bootstacktop[], bootstack[];
 
 extern struct PageInfo *pages;
 extern size_t npages;
+extern struct UStats *ustats;
 
 extern pde_t *kern_pgdir;
 
@@ -60,6 +61,8 @@ int	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
 void	page_remove(pde_t *pgdir, void *va);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void	page_decref(struct PageInfo *pp);
+int	page_cow_break(pde_t *pgdir, void *va);
+int	pgdir_copy(pde_t *dst, pde_t *src, uintptr_t limit, bool share_only);
 
 void	tlb_invalidate(pde_t *pgdir, void *va);
 
@@ -67,6 +70,17 @@ void *	mmio_map_region(physaddr_t pa, size_t size);
 
 int	user_mem_check(struct Env *env, const void *va, size_t len, int perm);
 void	user_mem_assert(struct Env *env, const void *va, size_t len, int perm);
+int	user_mem_pagein(struct Env *env, const void *va);
+int	user_arg_check(struct Env *env, const void *va, size_t len, int perm);
+int	user_arg_assert(struct Env *env, const void *va, size_t len, int perm);
+
+// pp_ref is shared by every address space that maps the page,
+// so it is only ever changed with locked instructions.
+static inline void
+page_incref(struct PageInfo *pp)
+{
+	asm volatile("lock; incw %0" : "+m" (pp->pp_ref) : : "cc");
+}
 
 static inline physaddr_t
 page2pa(struct PageInfo *pp)
@@ -0,0 +1,177 @@
+// Demand-zero regions.
+//
+// sys_region_reserve() records a range of an env's address space as
+// anonymous memory.  Nothing is mapped there until the env touches a
+// page, when page_fault_handler() maps a zeroed page with the region's
+// permissions: one trap, with no upcall to a user-level handler.  The
+// kernel faults pages in the same way when it checks user memory it is
+// about to access (user_mem_check()).
+//
+// A fault also maps the neighbors of the faulting page that the env is
+// likely to touch next: the other pages of the aligned window of
+// env_faultaround[] pages around it that are demand-zero, for a fault
+// in a region, or copy-on-write, for a write to a copy-on-write page.
+// Sequential writers, such as a forked child filling a buffer, then
+// take one fault per window instead of one per page.
+//
+// An env's regions are protected by its lock, like its page tables.
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/string.h>
+#include <kern/region.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
+
+struct region {
+	uintptr_t rg_start;
+	uintptr_t rg_end;		// 0 if the slot is free
+	int rg_perm;
+};
+
+// Regions of each env, indexed like envs[].  Kept out of struct Env
+// since that is also mapped to users.
+static struct region env_regions[NENV][NREGION];
+
+// Fault-around window of each env, in pages: 1 turns it off.
+static int env_faultaround[NENV];
+
+// Give a new env no regions.
+void
+region_env_init(struct Env *e)
+{
+	memset(env_regions[ENVX(e->env_id)], 0, sizeof(env_regions[0]));
+	env_faultaround[ENVX(e->env_id)] = FAULTAROUND_DEFAULT;
+}
+
+// Give curenv's new child the same regions: the pages curenv has not
+// touched yet are demand-zero in both.
+void
+region_fork(struct Env *child)
+{
+	memmove(env_regions[ENVX(child->env_id)],
+		env_regions[ENVX(curenv->env_id)], sizeof(env_regions[0]));
+	env_faultaround[ENVX(child->env_id)] =
+		env_faultaround[ENVX(curenv->env_id)];
+}
+
+//
+// Reserve [va, va+len) in e's address space as demand-zero memory
+// mapped with permission 'perm' (see sys_page_alloc).  Pages already
+// mapped there are left alone.  Called with e's lock held.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if va is not page-aligned, len is 0 or the range
+//		reaches past UTOP.
+//	-E_INVAL if perm is inappropriate.
+//	-E_INVAL if the range overlaps one of e's regions.
+//	-E_NO_MEM if e has NREGION regions already.
+//
+int
+region_reserve(struct Env *e, uintptr_t va, size_t len, int perm)
+{
+	struct region *rg, *free = NULL;
+	uintptr_t end;
+
+	len = ROUNDUP(len, PGSIZE);
+	end = va + len;
+	if (PGOFF(va) || len == 0 || end < va || end > UTOP)
+		return -E_INVAL;
+	if ((~perm & (PTE_U | PTE_P)) || (perm & ~PTE_SYSCALL) ||
+	    (perm & PTE_COW))
+		return -E_INVAL;
+
+	for (rg = env_regions[ENVX(e->env_id)];
+	     rg < env_regions[ENVX(e->env_id)] + NREGION; rg++) {
+		if (!rg->rg_end) {
+			if (!free)
+				free = rg;
+		} else if (va < rg->rg_end && rg->rg_start < end)
+			return -E_INVAL;
+	}
+	if (!free)
+		return -E_NO_MEM;
+
+	free->rg_start = va;
+	free->rg_end = end;
+	free->rg_perm = perm;
+	return 0;
+}
+
+//
+// Map a zeroed page at 'va' in e's address space if 'va' lies in one
+// of e's regions and nothing is mapped there yet.  Called with e's
+// lock held.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if va is in none of e's regions or is mapped already.
+//	-E_NO_MEM if there is no memory for the page or a page table.
+//
+int
+region_fault(struct Env *e, uintptr_t va)
+{
+	struct region *rg;
+	struct PageInfo *pp;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	for (rg = env_regions[ENVX(e->env_id)];
+	     rg < env_regions[ENVX(e->env_id)] + NREGION; rg++)
+		if (rg->rg_start <= va && va < rg->rg_end)
+			break;
+	if (rg == env_regions[ENVX(e->env_id)] + NREGION ||
+	    page_lookup(e->env_pgdir, (void *) va, NULL))
+		return -E_INVAL;
+
+	if (!(pp = page_alloc(ALLOC_ZERO)))
+		return -E_NO_MEM;
+	if (page_insert(e->env_pgdir, pp, (void *) va, rg->rg_perm) < 0) {
+		page_free(pp);
+		return -E_NO_MEM;
+	}
+	return 0;
+}
+
+//
+// e has just had the fault at 'va' resolved: a write to a copy-on-write
+// page if 'cow', or else a first touch of a demand-zero page.  Resolve
+// the same kind of fault ahead of time for the other pages of the
+// window around va, and count them in env_faults_avoided.  Gives up
+// quietly when memory runs out.  Called with e's lock held.
+//
+void
+region_fault_around(struct Env *e, uintptr_t va, bool cow)
+{
+	uintptr_t start, pva;
+	int r, n = env_faultaround[ENVX(e->env_id)];
+
+	start = ROUNDDOWN(va, n * PGSIZE);
+	va = ROUNDDOWN(va, PGSIZE);
+	for (pva = start; pva < start + n * PGSIZE; pva += PGSIZE) {
+		if (pva == va)
+			continue;
+		if (cow)
+			r = page_cow_break(e->env_pgdir, (void *) pva);
+		else
+			r = region_fault(e, pva);
+		if (r == -E_NO_MEM)
+			break;
+		if (r == 0)
+			e->env_faults_avoided++;
+	}
+}
+
+//
+// Set e's fault-around window to 'npages' pages; 1 turns fault-around
+// off.  Called with e's lock held.
+//
+// Returns 0 on success, -E_INVAL if npages is not a power of 2 between
+// 1 and FAULTAROUND_MAX.
+//
+int
+region_set_faultaround(struct Env *e, int npages)
+{
+	if (npages < 1 || npages > FAULTAROUND_MAX || (npages & (npages - 1)))
+		return -E_INVAL;
+	env_faultaround[ENVX(e->env_id)] = npages;
+	return 0;
+}
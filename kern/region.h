@@ -0,0 +1,25 @@
+#ifndef JOS_KERN_REGION_H
+#define JOS_KERN_REGION_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Demand-zero regions an env may have at once
+#define NREGION		8
+
+// Fault-around window, in pages, of new envs, and the largest allowed
+#define FAULTAROUND_DEFAULT	8
+#define FAULTAROUND_MAX		64
+
+struct Env;
+
+void region_env_init(struct Env *e);
+void region_fork(struct Env *child);
+int region_reserve(struct Env *e, uintptr_t va, size_t len, int perm);
+int region_fault(struct Env *e, uintptr_t va);
+void region_fault_around(struct Env *e, uintptr_t va, bool cow);
+int region_set_faultaround(struct Env *e, int npages);
+
+#endif	// !JOS_KERN_REGION_H
@@ -0,0 +1,316 @@
+// System call rings (see inc/syscall.h).
+//
+// The kernel drains an env's ring whenever the env enters the kernel,
+// and the ring drainer thread completes the sleeps of every ring that
+// are due from otherwise idle CPUs.  Submissions act on the env's
+// address space, so only the env's own kernel entries take them: a
+// CPU running the env would not see changes made from elsewhere, and
+// nothing would keep an env that is not running from being picked up
+// meanwhile.  The ring page is pinned while it is registered and read
+// through the kernel's mapping of it, so that sleeps can be completed
+// from any address space.  sr_sq_head and sr_cq_tail
+// are the kernel's own copies, r_sq_head and r_cq_tail, published to
+// the env; everything else in the page may change under the kernel.
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/string.h>
+#include <kern/ring.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
+#include <kern/syscall.h>
+#include <kern/time.h>
+#include <kern/kthread.h>
+
+struct ring {
+	struct spinlock r_lock;
+	envid_t r_env;			// Owner, or 0 if unregistered
+	struct SyscallRing *r_ring;	// Kernel address of the ring page
+	struct PageInfo *r_page;
+	uint32_t r_sq_head;
+	uint32_t r_cq_tail;
+	bool r_sleeping;		// A SYS_sleep is outstanding:
+	uint32_t r_sleep_seq;		// this submission,
+	uint64_t r_sleep_until;		// due at this time_usec()
+	struct waitqueue r_wq;		// The owner, in sys_ring_enter()
+};
+
+// Rings, indexed like envs[].  Kept out of struct Env since that is
+// also mapped to users.
+static struct ring env_rings[NENV];
+
+struct kthread *ring_drainer;
+volatile int ring_nactive;
+
+static void ring_drainer_main(void *arg);
+
+void
+ring_init(void)
+{
+	int i;
+
+	for (i = 0; i < NENV; i++)
+		__spin_initlock(&env_rings[i].r_lock, "ring_lock",
+				LOCK_RANK_RING, SPINLOCK_TAS);
+	if (kthread_create(&ring_drainer, "ringd", ring_drainer_main, NULL,
+			   KTHREAD_PRIO_IDLE) < 0)
+		panic("ring_init: cannot create the ring drainer");
+}
+
+// Drop r's registration.  Called with r->r_lock held.
+static void
+ring_release(struct ring *r)
+{
+	if (!r->r_env)
+		return;
+	page_decref(r->r_page);
+	r->r_env = 0;
+	r->r_ring = NULL;
+	r->r_page = NULL;
+	r->r_sleeping = false;
+	asm volatile("lock; decl %0" : "+m" (ring_nactive) : : "cc");
+}
+
+// Is there room for another completion?  Called with r->r_lock held.
+static bool
+ring_cq_room(struct ring *r)
+{
+	return r->r_cq_tail - r->r_ring->sr_cq_head < RING_NCQ;
+}
+
+// Post a completion.  Called with r->r_lock held.
+static void
+ring_complete(struct ring *r, uint32_t seq, int32_t ret)
+{
+	struct RingCompletion *rc = &r->r_ring->sr_cq[r->r_cq_tail % RING_NCQ];
+
+	rc->rc_seq = seq;
+	rc->rc_ret = ret;
+	// The completion must be visible before the new tail
+	asm volatile("" ::: "memory");
+	r->r_ring->sr_cq_tail = ++r->r_cq_tail;
+}
+
+// Carry out one submission for e.  Returns its result, or 1 if it
+// completes later.  Called with r->r_lock held.
+static int32_t
+ring_run(struct ring *r, struct Env *e, uint32_t seq, const struct Syscall *sc)
+{
+	switch (sc->sc_num) {
+	case SYS_page_alloc:
+	case SYS_page_map:
+	case SYS_page_unmap:
+		return syscall(sc->sc_num, sc->sc_args[0], sc->sc_args[1],
+			       sc->sc_args[2], sc->sc_args[3], sc->sc_args[4]);
+	case SYS_ipc_try_send:
+		return ipc_send_nowait(e, sc->sc_args[0], sc->sc_args[1],
+				       (void *) sc->sc_args[2], sc->sc_args[3]);
+	case SYS_sleep:
+		if (r->r_sleeping)
+			return -E_INVAL;
+		r->r_sleeping = true;
+		r->r_sleep_seq = seq;
+		r->r_sleep_until = time_usec() + sc->sc_args[0];
+		return 1;
+	default:
+		return -E_INVAL;
+	}
+}
+
+// Complete r's outstanding sleep if it is due.  Returns the number of
+// completions posted.  Called with r->r_lock held.
+static int
+ring_expire(struct ring *r)
+{
+	if (r->r_sleeping && time_usec() >= r->r_sleep_until &&
+	    ring_cq_room(r)) {
+		r->r_sleeping = false;
+		ring_complete(r, r->r_sleep_seq, 0);
+		return 1;
+	}
+	return 0;
+}
+
+// Take e's submissions and post their results, for as long as there
+// is room for them.  e must be curenv, so that the system calls act on
+// it.  Called without r->r_lock held.
+static void
+ring_drain(struct ring *r, struct Env *e)
+{
+	struct SyscallRing *sr;
+	struct Syscall sc;
+	uint32_t tail, seq;
+	uintptr_t pagein;
+	int32_t ret;
+	int posted = 0;
+
+	spin_lock(&r->r_lock);
+	if (r->r_env != e->env_id) {
+		spin_unlock(&r->r_lock);
+		return;
+	}
+	sr = r->r_ring;
+	posted += ring_expire(r);
+
+	// Ignore a tail that claims more than a full queue
+	tail = sr->sr_sq_tail;
+	if (tail - r->r_sq_head > RING_NSQ)
+		tail = r->r_sq_head;
+	// Read the submissions only after the tail
+	asm volatile("" ::: "memory");
+
+	while (r->r_sq_head != tail && ring_cq_room(r)) {
+		seq = r->r_sq_head;
+		// The env may rewrite the entry as we go: work on a copy
+		sc = sr->sr_sq[seq % RING_NSQ];
+		sr->sr_sq_head = ++r->r_sq_head;
+		// We may be draining on a kernel entry of e's pager, which
+		// must not be called again, so a submission is not paged in
+		// for (see user_arg_check()).  It fails with -E_PAGEIN, and
+		// ring_submit() pages in what it passes instead.
+		pagein = e->env_pagein_va;
+		ret = ring_run(r, e, seq, &sc);
+		e->env_pagein_va = pagein;
+		if (ret <= 0) {
+			ring_complete(r, seq, ret);
+			posted++;
+		}
+	}
+	spin_unlock(&r->r_lock);
+
+	if (posted)
+		wq_wakeup(&r->r_wq, -1, 0);
+}
+
+// Drain curenv e's ring if it has anything to do.  Called on every
+// kernel entry from e, so the check is cheap and takes no lock; a
+// submission it misses is taken on the next one.
+void
+ring_poll(struct Env *e)
+{
+	struct ring *r = &env_rings[ENVX(e->env_id)];
+	struct SyscallRing *sr = r->r_ring;
+
+	// The ring may be going away under another CPU, but its page can
+	// still be read; ring_drain() checks again under the lock
+	if (r->r_env == e->env_id && sr &&
+	    (r->r_sleeping || sr->sr_sq_tail != r->r_sq_head))
+		ring_drain(r, e);
+}
+
+// The ring drainer thread: complete the due sleeps of every ring, waking
+// their owners, and sleep until sched_tick() finds an idle CPU again.
+// It leaves submissions alone, to the owners' next kernel entries.
+static void
+ring_drainer_main(void *arg)
+{
+	struct ring *r;
+	int posted;
+
+	while (1) {
+		for (r = env_rings; ring_nactive && r < env_rings + NENV; r++) {
+			if (!r->r_env || !r->r_sleeping)
+				continue;
+			spin_lock(&r->r_lock);
+			posted = r->r_env ? ring_expire(r) : 0;
+			spin_unlock(&r->r_lock);
+			if (posted)
+				wq_wakeup(&r->r_wq, -1, 0);
+		}
+		kthread_sleep();
+	}
+}
+
+// Register the page at 'va' as e's ring, replacing any ring e had, or
+// unregister it if 'va' is NULL.  The page must be mapped writable.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if va >= UTOP, or va is not page-aligned.
+//	-E_INVAL if va is not mapped writable in e's address space.
+int
+ring_setup(struct Env *e, void *va)
+{
+	struct ring *r = &env_rings[ENVX(e->env_id)];
+	struct PageInfo *pp;
+	pte_t *pte;
+	int ret = 0;
+
+	if (va && ((uintptr_t) va >= UTOP || PGOFF(va)))
+		return -E_INVAL;
+
+	spin_lock(&r->r_lock);
+	ring_release(r);
+	if (va) {
+		lock_env(e);
+		pp = page_lookup(e->env_pgdir, va, &pte);
+		if (!pp || !(*pte & PTE_W))
+			ret = -E_INVAL;
+		else
+			page_incref(pp);
+		unlock_env(e);
+	}
+	if (va && ret == 0) {
+		r->r_env = e->env_id;
+		r->r_page = pp;
+		r->r_ring = page2kva(pp);
+		r->r_sq_head = r->r_ring->sr_sq_head = r->r_ring->sr_sq_tail;
+		r->r_cq_tail = r->r_ring->sr_cq_tail = r->r_ring->sr_cq_head;
+		asm volatile("lock; incl %0" : "+m" (ring_nactive) : : "cc");
+	}
+	spin_unlock(&r->r_lock);
+	return ret;
+}
+
+// Drain e's ring now.  With RING_WAIT, if there are no completions
+// waiting, sleep until one is posted: returns 0 once it is, or
+// -E_TIMEOUT when an outstanding sleep is due, which the next call
+// then completes.  Called by e itself.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if e has no ring, or flags are invalid.
+//	-E_INVAL with RING_WAIT if nothing is outstanding.
+int
+ring_enter(struct Env *e, int flags)
+{
+	struct ring *r = &env_rings[ENVX(e->env_id)];
+	uint64_t now;
+
+	if (flags & ~RING_WAIT)
+		return -E_INVAL;
+	ring_drain(r, e);
+
+	spin_lock(&r->r_lock);
+	if (r->r_env != e->env_id) {
+		spin_unlock(&r->r_lock);
+		return -E_INVAL;
+	}
+	if (!(flags & RING_WAIT) || r->r_cq_tail != r->r_ring->sr_cq_head) {
+		spin_unlock(&r->r_lock);
+		return 0;
+	}
+	if (!r->r_sleeping) {
+		spin_unlock(&r->r_lock);
+		return -E_INVAL;
+	}
+	now = time_usec();
+	if (now >= r->r_sleep_until) {
+		// Due, but the completion queue was full
+		spin_unlock(&r->r_lock);
+		return -E_TIMEOUT;
+	}
+	wq_sleep(&r->r_wq, &r->r_lock, MAX(r->r_sleep_until - now, 1));
+}
+
+// e is being torn down: unpin its ring.
+void
+ring_env_free(struct Env *e)
+{
+	struct ring *r = &env_rings[ENVX(e->env_id)];
+
+	spin_lock(&r->r_lock);
+	if (r->r_env == e->env_id)
+		ring_release(r);
+	spin_unlock(&r->r_lock);
+}
@@ -0,0 +1,20 @@
+#ifndef JOS_KERN_RING_H
+#define JOS_KERN_RING_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Env;
+
+extern struct kthread *ring_drainer;	// Completes ring sleeps on idle CPUs
+extern volatile int ring_nactive;	// Rings registered
+
+void ring_init(void);
+void ring_poll(struct Env *e);
+void ring_env_free(struct Env *e);
+int ring_setup(struct Env *e, void *va);
+int ring_enter(struct Env *e, int flags);
+
+#endif	// !JOS_KERN_RING_H
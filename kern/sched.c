@@ -1,47 +1,434 @@
 #include <inc/assert.h>
+#include <inc/error.h>
 #include <inc/x86.h>
 #include <kern/spinlock.h>
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/sched.h>
+#include <kern/time.h>
+#include <kern/fpu.h>
+#include <kern/kthread.h>
+#include <kern/ring.h>
 
-void sched_halt(void);
+void sched_halt(void) __attribute__((noreturn));
+
+volatile uint32_t sched_ticks;
+
+// Timeouts of sleeping envs, indexed like envs[], protected by
+// env_table_lock.  Kept out of struct Env since that is also mapped to
+// users.
+static struct timer env_timers[NENV];
+
+/***** Run queues *****/
+// Every ENV_RUNNABLE env is on exactly one CPU's run queue.  All run
+// queues are protected by env_table_lock, which also guards env_status
+// and the wait queues, so scheduling is still serialized across CPUs:
+// the queues being per-CPU keeps envs on the CPUs they last ran on and
+// spares scans of envs[], but does not let CPUs schedule in parallel.
+// Giving each queue a lock of its own would take moving env_status
+// transitions out from under env_table_lock too.
+
+// Queue e on c.  A halted CPU would only notice on its next timer
+// tick, so kick it with an IPI.
+static void
+runq_push(struct CpuInfo *c, struct Env *e)
+{
+	e->env_runq_next = NULL;
+	e->env_runq_cpu = c - cpus;
+	if (c->cpu_runq_tail)
+		c->cpu_runq_tail->env_runq_next = e;
+	else
+		c->cpu_runq_head = e;
+	c->cpu_runq_tail = e;
+	c->cpu_runq_len++;
+	ustats->us_cpus[c - cpus].usc_runq_len = c->cpu_runq_len;
+
+	if (c != thiscpu && c->cpu_status == CPU_HALTED)
+		lapic_ipi_cpu(c->cpu_id, IRQ_OFFSET + IRQ_RESCHED);
+}
+
+static struct Env *
+runq_pop(struct CpuInfo *c)
+{
+	struct Env *e = c->cpu_runq_head;
+
+	if (e) {
+		c->cpu_runq_head = e->env_runq_next;
+		if (!c->cpu_runq_head)
+			c->cpu_runq_tail = NULL;
+		c->cpu_runq_len--;
+		ustats->us_cpus[c - cpus].usc_runq_len = c->cpu_runq_len;
+		e->env_runq_next = NULL;
+		e->env_runq_cpu = -1;
+	}
+	return e;
+}
+
+static void
+runq_remove(struct Env *e)
+{
+	struct CpuInfo *c = &cpus[e->env_runq_cpu];
+	struct Env **pp, *prev = NULL;
+
+	for (pp = &c->cpu_runq_head; *pp; prev = *pp, pp = &(*pp)->env_runq_next)
+		if (*pp == e) {
+			*pp = e->env_runq_next;
+			if (c->cpu_runq_tail == e)
+				c->cpu_runq_tail = prev;
+			c->cpu_runq_len--;
+			ustats->us_cpus[c - cpus].usc_runq_len = c->cpu_runq_len;
+			break;
+		}
+	e->env_runq_next = NULL;
+	e->env_runq_cpu = -1;
+}
+
+// May e run on CPU c?
+static bool
+runq_allowed(struct Env *e, struct CpuInfo *c)
+{
+	return e->env_cpumask & (1 << (c - cpus));
+}
+
+// Envs waiting for CPU c: its queue, plus the env it is running.
+static int
+runq_load(struct CpuInfo *c)
+{
+	return c->cpu_runq_len + (c->cpu_status != CPU_HALTED);
+}
+
+// Pick the run queue for an env that just became runnable: that of
+// the least loaded CPU in its affinity mask, so a halted CPU takes it
+// at once, preferring the CPU the env last ran on.
+static struct CpuInfo *
+runq_select(struct Env *e)
+{
+	struct CpuInfo *best = NULL;
+	int i;
+
+	if (e->env_runs > 0 && e->env_cpunum < ncpu &&
+	    runq_allowed(e, &cpus[e->env_cpunum]))
+		best = &cpus[e->env_cpunum];
+	for (i = 0; i < ncpu; i++)
+		if (runq_allowed(e, &cpus[i]) &&
+		    (!best || runq_load(&cpus[i]) < runq_load(best)))
+			best = &cpus[i];
+	// sys_env_set_affinity() never leaves a mask without a CPU
+	assert(best);
+	return best;
+}
+
+// Take the first env queued on another CPU that may run on c, for a
+// CPU whose own run queue is empty.
+static struct Env *
+runq_steal(struct CpuInfo *c)
+{
+	struct Env *e;
+	int i;
+
+	for (i = 1; i < ncpu; i++)
+		for (e = cpus[(c - cpus + i) % ncpu].cpu_runq_head; e; e = e->env_runq_next)
+			if (runq_allowed(e, c)) {
+				runq_remove(e);
+				return e;
+			}
+	return NULL;
+}
+
+/***** Wait queues *****/
+
+static void
+wq_remove(struct Env *e)
+{
+	struct waitqueue *wq = e->env_wait_queue;
+	struct Env **pp, *prev = NULL;
+
+	for (pp = &wq->wq_head; *pp; prev = *pp, pp = &(*pp)->env_wait_next)
+		if (*pp == e) {
+			*pp = e->env_wait_next;
+			if (wq->wq_tail == e)
+				wq->wq_tail = prev;
+			break;
+		}
+	e->env_wait_next = NULL;
+	e->env_wait_queue = NULL;
+	e->env_wait_key = 0;
+}
+
+// Timer callback for an env whose sleep has timed out.
+static void
+sleep_timeout(void *arg)
+{
+	struct Env *e = arg;
+
+	if (e->env_status != ENV_NOT_RUNNABLE)
+		return;
+	// A plain timed sleep has succeeded; a wait has failed.
+	e->env_tf.tf_regs.reg_eax = e->env_wait_queue ? -E_TIMEOUT : 0;
+	sched_set_status(e, ENV_RUNNABLE);
+}
+
+// Set e's status, keeping the queues consistent: an ENV_RUNNABLE env
+// is on a run queue, and an env leaving ENV_NOT_RUNNABLE is taken off
+// any wait queue it sleeps on and its timeout is cancelled.
+// Called with env_table_lock held.
+void
+sched_set_status(struct Env *e, unsigned status)
+{
+	if (e->env_status == ENV_RUNNABLE && status != ENV_RUNNABLE)
+		runq_remove(e);
+	if (e->env_wait_queue && status != ENV_NOT_RUNNABLE)
+		wq_remove(e);
+	if (status != ENV_NOT_RUNNABLE)
+		timer_del(&env_timers[ENVX(e->env_id)]);
+	if (status == ENV_RUNNABLE && e->env_status != ENV_RUNNABLE)
+		runq_push(runq_select(e), e);
+	e->env_status = status;
+}
+
+// Restrict e to the CPUs in 'mask', which must include an active CPU.
+// A queued env moves to a run queue it is allowed on at once; one
+// running on another CPU that it may no longer use is preempted there.
+// Called with env_table_lock held.
+void
+sched_set_affinity(struct Env *e, uint32_t mask)
+{
+	struct CpuInfo *c;
+
+	e->env_cpumask = mask;
+	if (e->env_status == ENV_RUNNABLE &&
+	    !runq_allowed(e, &cpus[e->env_runq_cpu])) {
+		runq_remove(e);
+		runq_push(runq_select(e), e);
+	} else if (e->env_status == ENV_RUNNING && e != curenv) {
+		c = &cpus[e->env_cpunum];
+		if (!runq_allowed(e, c))
+			lapic_ipi_cpu(c->cpu_id, IRQ_OFFSET + IRQ_RESCHED);
+	}
+}
+
+// Put curenv to sleep on 'wq' and give up the CPU.  'lk' is the lock
+// protecting the condition being waited for; it is released once
+// curenv is queued, so a wakeup issued after the condition changes
+// cannot be missed.  'lk' may be NULL, or env_table_lock itself for
+// conditions checked under it.
+//
+// The system call that slept returns the value passed to wq_wakeup(),
+// or -E_TIMEOUT if 'timeout' microseconds pass first (0: no timeout).
+// With a NULL 'wq' curenv just sleeps for 'timeout' and returns 0.
+// Callers must be prepared for the condition to be false again by the
+// time curenv runs.
+void
+wq_sleep(struct waitqueue *wq, struct spinlock *lk, uint32_t timeout)
+{
+	wq_sleep_key(wq, 0, lk, timeout);
+}
+
+// Like wq_sleep(), but tags the sleeper with 'key' so that several
+// conditions can share one queue; see wq_wakeup_key().
+void
+wq_sleep_key(struct waitqueue *wq, uintptr_t key, struct spinlock *lk,
+	     uint32_t timeout)
+{
+	if (lk != &env_table_lock)
+		spin_lock(&env_table_lock);
+	// A zombie stays a zombie so that sched_run() frees it
+	if (curenv->env_status == ENV_RUNNING) {
+		curenv->env_status = ENV_NOT_RUNNABLE;
+		if (wq) {
+			curenv->env_wait_queue = wq;
+			curenv->env_wait_key = key;
+			curenv->env_wait_next = NULL;
+			if (wq->wq_tail)
+				wq->wq_tail->env_wait_next = curenv;
+			else
+				wq->wq_head = curenv;
+			wq->wq_tail = curenv;
+		}
+		if (timeout) {
+			struct timer *t = &env_timers[ENVX(curenv->env_id)];
+			timer_init(t, sleep_timeout, curenv, &env_table_lock);
+			timer_add(t, timeout);
+		}
+	}
+	if (lk && lk != &env_table_lock)
+		spin_unlock(lk);
+	sched_run();
+}
+
+// Wake up to 'n' envs sleeping on 'wq' (all of them if n < 0), in the
+// order they went to sleep.  Each returns 'retval' from the system
+// call it slept in.  Returns the number of envs woken.
+int
+wq_wakeup(struct waitqueue *wq, int n, int32_t retval)
+{
+	struct Env *e;
+	int woken = 0;
+
+	spin_lock(&env_table_lock);
+	while ((n < 0 || woken < n) && (e = wq->wq_head) != NULL) {
+		e->env_tf.tf_regs.reg_eax = retval;
+		sched_set_status(e, ENV_RUNNABLE);
+		woken++;
+	}
+	spin_unlock(&env_table_lock);
+	return woken;
+}
+
+// Like wq_wakeup(), but only wakes envs that went to sleep with
+// wq_sleep_key() and the same 'key'.
+int
+wq_wakeup_key(struct waitqueue *wq, uintptr_t key, int n, int32_t retval)
+{
+	return wq_wakeup_range(wq, key, key + 1, n, retval);
+}
+
+// Like wq_wakeup_key(), but wakes envs whose key is in [lo, hi).
+int
+wq_wakeup_range(struct waitqueue *wq, uintptr_t lo, uintptr_t hi, int n,
+		int32_t retval)
+{
+	struct Env *e, *next;
+	int woken = 0;
+
+	spin_lock(&env_table_lock);
+	for (e = wq->wq_head; e && (n < 0 || woken < n); e = next) {
+		next = e->env_wait_next;
+		if (e->env_wait_key < lo || e->env_wait_key >= hi)
+			continue;
+		e->env_tf.tf_regs.reg_eax = retval;
+		sched_set_status(e, ENV_RUNNABLE);
+		woken++;
+	}
+	spin_unlock(&env_table_lock);
+	return woken;
+}
+
+// Number of halted CPUs.
+static int
+sched_idle_cpus(void)
+{
+	int i, n = 0;
+
+	for (i = 0; i < ncpu; i++)
+		if (cpus[i].cpu_status == CPU_HALTED)
+			n++;
+	return n;
+}
+
+// Called on every CPU from the timer interrupt: expire this CPU's
+// timers, which takes env_table_lock only if a sleep times out.  The
+// boot CPU also counts ticks, in sched_ticks and the statistics page,
+// and looks after the kernel threads.
+void
+sched_tick(void)
+{
+	if (thiscpu == bootcpu)
+		ustats->us_ticks = ++sched_ticks;
+
+	timer_run();
+	if (thiscpu != bootcpu)
+		return;
+	spin_lock(&env_table_lock);
+	// Dying envs are normally freed by the reaper on idle CPUs.
+	// With none idle, have it take turns with the envs until it is
+	// done, so that they still go away.
+	if (!sched_idle_cpus() && env_reap_pending())
+		kthread_set_prio(env_reaper, KTHREAD_PRIO_NORMAL);
+	// Let an idle CPU complete the sleeps of system call rings
+	if (ring_nactive && sched_idle_cpus())
+		kthread_wakeup(ring_drainer);
+	spin_unlock(&env_table_lock);
+}
+
+/***** Scheduler *****/
 
 // Choose a user environment to run and run it.
 void
 sched_yield(void)
 {
-	struct Env *idle;
+	spin_lock(&env_table_lock);
+	sched_run();
+}
+
+// Give the rest of curenv's time slice to env 'envid' if it is
+// runnable and may run on this CPU; otherwise just yield.
+void
+sched_yield_to(envid_t envid)
+{
+	struct Env *e;
 
-	// Implement simple round-robin scheduling.
-	//
-	// Search through 'envs' for an ENV_RUNNABLE environment in
-	// circular fashion starting just after the env this CPU was
-	// last running.  Switch to the first such environment found.
-	//
-	// If no envs are runnable, but the environment previously
-	// running on this CPU is still ENV_RUNNING, it's okay to
-	// choose that environment. Make sure curenv is not null before
-	// dereferencing it.
+	spin_lock(&env_table_lock);
+	if (envid2env(envid, &e, false) == 0 && e->env_id == envid &&
+	    e != curenv && e->env_status == ENV_RUNNABLE &&
+	    runq_allowed(e, thiscpu) && curenv->env_status == ENV_RUNNING) {
+		// env_run() puts curenv back on a run queue
+		runq_remove(e);
+		env_run(e);
+	}
+	sched_run();
+}
+
+// Mark curenv ENV_NOT_RUNNABLE, release 'lk' and give up the CPU.
+// 'lk' is only released once env_table_lock is held, so a wakeup
+// issued under 'lk' cannot slip in before curenv is marked asleep.
+void
+sched_sleep(struct spinlock *lk)
+{
+	spin_lock(&env_table_lock);
+	// A zombie stays a zombie so that sched_run() frees it
+	if (curenv->env_status == ENV_RUNNING)
+		curenv->env_status = ENV_NOT_RUNNABLE;
+	if (lk)
+		spin_unlock(lk);
+	sched_run();
+}
+
+// The scheduler proper.  Called with env_table_lock held.
+void
+sched_run(void)
+{
+	struct Env *e;
+	struct kthread *kt;
+
+	// curenv was marked ENV_DYING by another CPU while we were in
+	// the kernel on its behalf; nobody else can run it, so reap it.
+	if (curenv != NULL && curenv->env_status == ENV_DYING) {
+		spin_unlock(&env_table_lock);
+		env_reap_later(curenv);
+		spin_lock(&env_table_lock);
+	}
+
+	// Round-robin over this CPU's run queue; env_run() puts a
+	// preempted curenv back on a run queue.  With nothing queued here,
+	// take work from another CPU before settling for curenv.
 	//
 	// Never choose an environment that's currently running on
-	// another CPU (env_status == ENV_RUNNING). If there are
-	// no runnable environments, simply drop through to the code
-	// below to halt the cpu.
-
-	// LAB 4: Your code here.
-	for (int i = 0, j = curenv == NULL ? 0 : ENVX(curenv->env_id); i < NENV; i++, j++)
-	{
-		if (j >= NENV) j -= NENV;
-		if (envs[j].env_status == ENV_RUNNABLE)
-		{
-			env_run(&envs[j]);
-		}
-	}
-	if (curenv != NULL && curenv->env_status == ENV_RUNNING)
-	{
-		env_run(curenv);
+	// another CPU (env_status == ENV_RUNNING): those are on no run
+	// queue.  If there is nothing to run, halt the CPU.
+	//
+	// Kernel threads fit in by priority: high ones go first, normal
+	// ones alternate with this CPU's envs, and idle ones only run
+	// when there is nothing else to do.
+	if ((kt = kthread_next(KTHREAD_PRIO_HIGH)) != NULL)
+		kthread_run(kt);
+	thiscpu->cpu_kthread_turn = !thiscpu->cpu_kthread_turn;
+	if (thiscpu->cpu_kthread_turn &&
+	    (kt = kthread_next(KTHREAD_PRIO_NORMAL)) != NULL)
+		kthread_run(kt);
+	if ((e = runq_pop(thiscpu)) != NULL || (e = runq_steal(thiscpu)) != NULL)
+		env_run(e);
+	if ((kt = kthread_next(KTHREAD_PRIO_NORMAL)) != NULL)
+		kthread_run(kt);
+	if (curenv != NULL && curenv->env_status == ENV_RUNNING) {
+		if (runq_allowed(curenv, thiscpu))
+			env_run(curenv);
+		// Its affinity has changed: send it where it may run
+		sched_set_status(curenv, ENV_RUNNABLE);
 	}
+	if ((kt = kthread_next(KTHREAD_PRIO_IDLE)) != NULL)
+		kthread_run(kt);
 
 	// sched_halt never returns
 	sched_halt();
@@ -49,6 +436,7 @@ sched_yield(void)
 
 // Halt this CPU when there is nothing to do. Wait until the
 // timer interrupt wakes it up. This function never returns.
+// Called with env_table_lock held.
 //
 void
 sched_halt(void)
@@ -57,29 +445,36 @@ sched_halt(void)
 
 	// For debugging and testing purposes, if there are no runnable
 	// environments in the system, then drop into the kernel monitor.
+	// Envs on a wait queue or with a timeout pending count as
+	// runnable: an interrupt or a timer will wake them.  So does a
+	// kernel thread at work on another CPU, which may yet wake some.
+	// env_table_lock stays held, which keeps other CPUs out of it.
 	for (i = 0; i < NENV; i++) {
 		if ((envs[i].env_status == ENV_RUNNABLE ||
 		     envs[i].env_status == ENV_RUNNING ||
-		     envs[i].env_status == ENV_DYING))
+		     envs[i].env_status == ENV_DYING ||
+		     envs[i].env_wait_queue ||
+		     timer_pending(&env_timers[i])))
 			break;
 	}
-	if (i == NENV) {
+	if (i == NENV && !kthread_busy()) {
 		cprintf("No runnable environments in the system!\n");
 		while (1)
 			monitor(NULL);
 	}
 
 	// Mark that no environment is running on this CPU
+	fpu_switch(NULL);
 	curenv = NULL;
 	lcr3(PADDR(kern_pgdir));
 
-	// Mark that this CPU is in the HALT state, so that when
-	// timer interupts come in, we know we should re-acquire the
-	// big kernel lock
+	// Mark that this CPU is in the HALT state; trap() accounts for
+	// the idle time when it wakes up
+	thiscpu->cpu_halt_tsc = read_tsc();
 	xchg(&thiscpu->cpu_status, CPU_HALTED);
 
-	// Release the big kernel lock as if we were "leaving" the kernel
-	unlock_kernel();
+	// Release the scheduler lock as if we were "leaving" the kernel
+	spin_unlock(&env_table_lock);
 
 	// Reset stack pointer, enable interrupts and then halt.
 	asm volatile (
@@ -93,5 +488,6 @@ sched_halt(void)
 		"hlt\n"
 		"jmp 1b\n"
 	: : "a" (thiscpu->cpu_ts.ts_esp0));
+	panic("sched_halt: hlt loop returned");  /* placate the compiler */
 }
 
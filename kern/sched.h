@@ -6,7 +6,37 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
-// This function does not return.
+#include <inc/types.h>
+#include <inc/env.h>
+
+struct spinlock;
+
+// A queue of envs sleeping until some condition holds.  Wait queues
+// are protected by env_table_lock; a zeroed waitqueue is empty.
+struct waitqueue {
+	struct Env *wq_head;
+	struct Env *wq_tail;
+};
+
+// Timer ticks since boot, counted on the boot CPU.
+extern volatile uint32_t sched_ticks;
+
+// These functions do not return.
 void sched_yield(void) __attribute__((noreturn));
+void sched_run(void) __attribute__((noreturn));
+void sched_yield_to(envid_t envid) __attribute__((noreturn));
+void sched_sleep(struct spinlock *lk) __attribute__((noreturn));
+void wq_sleep(struct waitqueue *wq, struct spinlock *lk, uint32_t timeout)
+	__attribute__((noreturn));
+void wq_sleep_key(struct waitqueue *wq, uintptr_t key, struct spinlock *lk,
+		  uint32_t timeout) __attribute__((noreturn));
+
+int wq_wakeup(struct waitqueue *wq, int n, int32_t retval);
+int wq_wakeup_key(struct waitqueue *wq, uintptr_t key, int n, int32_t retval);
+int wq_wakeup_range(struct waitqueue *wq, uintptr_t lo, uintptr_t hi, int n,
+		    int32_t retval);
+void sched_set_status(struct Env *e, unsigned status);
+void sched_set_affinity(struct Env *e, uint32_t mask);
+void sched_tick(void);
 
 #endif	// !JOS_KERN_SCHED_H
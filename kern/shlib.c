@@ -0,0 +1,107 @@
+// The shared libjos.
+//
+// libjos is linked at ULIB as an image of its own (lib/lib.ld), which
+// is embedded in the kernel, and programs only take its symbols, so
+// they carry none of its code.  shlib_init() loads the image once, at
+// boot, and shlib_map() maps it into each new env, before it runs a
+// program: the pages of its text are shared read-only by every env,
+// those of its data are mapped copy-on-write, so that an env writing
+// them gets a copy and the loaded pages keep their initial contents
+// for the next env, and its BSS is left demand-zero (kern/region.c).
+// fork() copies the mappings like any others.
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/elf.h>
+#include <kern/shlib.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/region.h>
+
+#define SHLIB_NPAGES	((PTSIZE / 2 - PGSIZE) / PGSIZE)	// ULIB to PFTEMP
+
+extern uint8_t _binary_obj_lib_libjos_start[];
+
+// The loaded pages of libjos, at ULIB + i * PGSIZE, and how they are
+// mapped into envs.  NULL for pages outside its segments or BSS.
+static struct PageInfo *shlib_pages[SHLIB_NPAGES];
+static int shlib_perm[SHLIB_NPAGES];
+
+// libjos' BSS past its data pages
+static uintptr_t shlib_bss, shlib_end;
+
+// Load the libjos image, panicking if it is malformed.
+void
+shlib_init(void)
+{
+	const struct Elf *elf = (const struct Elf *) _binary_obj_lib_libjos_start;
+	const struct Proghdr *ph, *eph;
+	struct PageInfo *pp;
+	uintptr_t va, fend, bss, end;
+	size_t lo, hi;
+	int perm;
+
+	if (elf->e_magic != ELF_MAGIC)
+		panic("shlib_init: libjos is not ELF");
+	ph = (const struct Proghdr *) ((uint8_t *) elf + elf->e_phoff);
+	eph = ph + elf->e_phnum;
+	for (; ph < eph; ph++) {
+		if (ph->p_type != ELF_PROG_LOAD || ph->p_memsz == 0)
+			continue;
+		if (ph->p_filesz > ph->p_memsz || ph->p_va < (uintptr_t) ULIB ||
+		    ph->p_memsz > (uintptr_t) PFTEMP - ph->p_va)
+			panic("shlib_init: libjos segment at 0x%08x", ph->p_va);
+
+		perm = PTE_P | PTE_U;
+		if (ph->p_flags & ELF_PROG_FLAG_WRITE)
+			perm |= PTE_COW;
+		fend = ph->p_va + ph->p_filesz;
+		end = ph->p_va + ph->p_memsz;
+		bss = ROUNDUP(fend, PGSIZE);
+
+		for (va = ROUNDDOWN(ph->p_va, PGSIZE); va < MIN(bss, end); va += PGSIZE) {
+			if (!(pp = page_alloc(ALLOC_ZERO)))
+				panic("shlib_init: out of memory");
+			// Never freed: the reference keeps data pages
+			// copy-on-write in every env
+			page_incref(pp);
+			lo = MAX(va, ph->p_va);
+			hi = MIN(va + PGSIZE, fend);
+			memcpy(page2kva(pp) + (lo - va),
+			       (uint8_t *) elf + ph->p_offset + (lo - ph->p_va),
+			       hi - lo);
+			shlib_pages[PGNUM(va - (uintptr_t) ULIB)] = pp;
+			shlib_perm[PGNUM(va - (uintptr_t) ULIB)] = perm;
+		}
+		if (end > bss) {
+			if (shlib_end)
+				panic("shlib_init: libjos has two BSS segments");
+			shlib_bss = bss;
+			shlib_end = end;
+		}
+	}
+}
+
+//
+// Map libjos into e, which must not be running.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if libjos' BSS overlaps a region e has reserved.
+//	-E_NO_MEM on memory exhaustion.
+//
+int
+shlib_map(struct Env *e)
+{
+	int i, r;
+
+	for (i = 0; i < SHLIB_NPAGES; i++)
+		if (shlib_pages[i] &&
+		    (r = page_insert(e->env_pgdir, shlib_pages[i],
+				     ULIB + i * PGSIZE, shlib_perm[i])) < 0)
+			return r;
+	if (shlib_end)
+		return region_reserve(e, shlib_bss, shlib_end - shlib_bss,
+				      PTE_P | PTE_U | PTE_W);
+	return 0;
+}
@@ -0,0 +1,12 @@
+#ifndef JOS_KERN_SHLIB_H
+#define JOS_KERN_SHLIB_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+struct Env;
+
+void shlib_init(void);
+int shlib_map(struct Env *e);
+
+#endif	// !JOS_KERN_SHLIB_H
@@ -9,14 +9,27 @@
 #include <kern/spinlock.h>
 #include <kern/kdebug.h>
 
-// The big kernel lock
-struct spinlock kernel_lock = {
-#ifdef DEBUG_SPINLOCK
-	.name = "kernel_lock"
-#endif
-};
+// MCS queue node.  A waiter spins on its own node, which sits on its
+// own cache line, so a release only disturbs the next waiter.
+struct mcs_node {
+	struct mcs_node *volatile next;
+	volatile unsigned waiting;
+	bool in_use;
+} __attribute__((aligned(CACHELINE)));
+
+// Each CPU needs one node per MCS lock it holds or waits for.
+#define NMCSNODE	4
+static struct mcs_node mcs_nodes[NCPU][NMCSNODE];
 
 #ifdef DEBUG_SPINLOCK
+// Locks currently held by each CPU, in acquisition order, used to
+// check every acquisition against the lock order in kern/spinlock.h.
+#define NHELD	8
+static struct {
+	struct spinlock *locks[NHELD];
+	int n;
+} __attribute__((aligned(CACHELINE))) held[NCPU];
+
 // Record the current call stack in pcs[] by following the %ebp chain.
 static void
 get_caller_pcs(uint32_t pcs[])
@@ -41,18 +54,328 @@ holding(struct spinlock *lock)
 {
 	return lock->locked && lock->cpu == thiscpu;
 }
+
+// Panic if acquiring lk could deadlock against a lock this CPU holds.
+static void
+check_lock_order(struct spinlock *lk)
+{
+	int i;
+
+	if (lk->rank == LOCK_RANK_NONE)
+		return;
+	for (i = 0; i < held[cpunum()].n; i++) {
+		struct spinlock *h = held[cpunum()].locks[i];
+		if (h->rank != LOCK_RANK_NONE && h->rank >= lk->rank)
+			panic("CPU %d lock order violation: acquiring %s (rank %d) "
+			      "while holding %s (rank %d)", cpunum(),
+			      lk->name, lk->rank, h->name, h->rank);
+	}
+}
+
+static void
+push_held(struct spinlock *lk)
+{
+	int c = cpunum();
+
+	if (held[c].n == NHELD)
+		panic("CPU %d holds too many locks", c);
+	held[c].locks[held[c].n++] = lk;
+}
+
+// Locks need not be released in LIFO order (sleeping releases the
+// caller's lock while the scheduler's is held), so search the list.
+static void
+pop_held(struct spinlock *lk)
+{
+	int c = cpunum();
+	int i;
+
+	for (i = held[c].n - 1; i >= 0; i--)
+		if (held[c].locks[i] == lk)
+			break;
+	if (i < 0)
+		return;
+	for (; i < held[c].n - 1; i++)
+		held[c].locks[i] = held[c].locks[i + 1];
+	held[c].n--;
+}
+#endif
+
+#ifdef PROFILE_SPINLOCK
+// All locks that have been acquired at least once, linked through
+// stat.next.  Locks are only ever added, so the list can be walked
+// without a lock.
+static struct spinlock *volatile lockstat_list;
+
+static const char *
+lock_name(struct spinlock *lk)
+{
+#ifdef DEBUG_SPINLOCK
+	return lk->name;
+#else
+	return "?";
+#endif
+}
+
+// Account for an acquisition of lk that started spinning at t0.
+// ebp is spin_lock()'s frame pointer.  Called with lk held.
+static void
+lockstat_acquired(struct spinlock *lk, uint64_t t0, bool contended,
+		  uint32_t *ebp)
+{
+	struct lockstat *st = &lk->stat;
+	struct lockstat_site *s, *victim;
+	uint64_t now = read_tsc(), spin = now - t0;
+	uintptr_t pcs[2];
+	int i;
+
+	if (!st->registered) {
+		st->registered = 1;
+		do
+			st->next = lockstat_list;
+		while (cmpxchg((volatile uint32_t *) &lockstat_list,
+			       (uint32_t) st->next, (uint32_t) lk)
+		       != (uint32_t) st->next);
+	}
+
+	st->acquires++;
+	st->hold_start = now;
+	if (!contended)
+		return;
+	st->contended++;
+	st->spin_total += spin;
+	if (spin > st->spin_max)
+		st->spin_max = spin;
+
+	// Charge the spin to the call site.  When the table is full,
+	// evict the site with the fewest contended acquisitions.
+	pcs[0] = ebp[1];
+	pcs[1] = ((uint32_t *) ebp[0] >= (uint32_t *) ULIM) ?
+		((uint32_t *) ebp[0])[1] : 0;
+	victim = &st->sites[0];
+	for (i = 0; i < LOCKSTAT_NSITE; i++) {
+		s = &st->sites[i];
+		if (s->pcs[0] == pcs[0] && s->pcs[1] == pcs[1])
+			break;
+		if (s->count < victim->count)
+			victim = s;
+	}
+	if (i == LOCKSTAT_NSITE) {
+		s = victim;
+		s->pcs[0] = pcs[0];
+		s->pcs[1] = pcs[1];
+		s->count = 0;
+		s->spin = 0;
+	}
+	s->count++;
+	s->spin += spin;
+}
+
+// Account for the hold time of lk.  Called just before lk is released.
+static void
+lockstat_released(struct spinlock *lk)
+{
+	struct lockstat *st = &lk->stat;
+	uint64_t hold = read_tsc() - st->hold_start;
+	uint64_t bound = LOCKSTAT_HIST0;
+	int b;
+
+	st->hold_total += hold;
+	for (b = 0; b < LOCKSTAT_NHIST - 1 && hold >= bound; b++)
+		bound <<= 1;
+	st->hold_hist[b]++;
+}
+
+static void
+print_pc(uintptr_t pc)
+{
+	struct Eipdebuginfo info;
+
+	if (debuginfo_eip(pc, &info) >= 0)
+		cprintf("%s:%d: %.*s+%x", info.eip_file, info.eip_line,
+			info.eip_fn_namelen, info.eip_fn_name,
+			pc - info.eip_fn_addr);
+	else
+		cprintf("%08x", pc);
+}
+
+#define LOCKSTAT_NDUMP	8	// locks shown by spin_stats_dump
+
+void
+spin_stats_dump(bool reset)
+{
+	struct spinlock *top[LOCKSTAT_NDUMP], *lk;
+	struct lockstat *st;
+	int ntop = 0, i, j;
+
+	// Pick the locks with the most spin time, then the most
+	// acquisitions.  There are NENV per-env locks, so only the
+	// busiest are worth printing.
+	for (lk = lockstat_list; lk; lk = lk->stat.next) {
+		if (!lk->stat.acquires)
+			continue;
+		for (i = ntop; i > 0; i--) {
+			st = &top[i - 1]->stat;
+			if (st->spin_total > lk->stat.spin_total ||
+			    (st->spin_total == lk->stat.spin_total &&
+			     st->acquires >= lk->stat.acquires))
+				break;
+			if (i < LOCKSTAT_NDUMP)
+				top[i] = top[i - 1];
+		}
+		if (i < LOCKSTAT_NDUMP) {
+			top[i] = lk;
+			if (ntop < LOCKSTAT_NDUMP)
+				ntop++;
+		}
+	}
+
+	cprintf("%-16s %10s %10s %12s %10s %10s\n", "lock", "acquires",
+		"contended", "spin total", "spin max", "hold avg");
+	for (i = 0; i < ntop; i++) {
+		st = &top[i]->stat;
+		cprintf("%-16s %10llu %10llu %12llu %10llu %10llu\n",
+			lock_name(top[i]), st->acquires, st->contended,
+			st->spin_total, st->spin_max,
+			st->hold_total / st->acquires);
+
+		cprintf("  hold cycles:");
+		for (j = 0; j < LOCKSTAT_NHIST; j++)
+			if (st->hold_hist[j]) {
+				if (j == LOCKSTAT_NHIST - 1)
+					cprintf(" >=%u:%u",
+						LOCKSTAT_HIST0 << (j - 1),
+						st->hold_hist[j]);
+				else
+					cprintf(" <%u:%u", LOCKSTAT_HIST0 << j,
+						st->hold_hist[j]);
+			}
+		cprintf("\n");
+
+		for (j = 0; j < LOCKSTAT_NSITE; j++) {
+			struct lockstat_site *s = &st->sites[j];
+			if (!s->count)
+				continue;
+			cprintf("  %8u waits %12llu cycles  ", s->count, s->spin);
+			print_pc(s->pcs[0]);
+			if (s->pcs[1]) {
+				cprintf(" <- ");
+				print_pc(s->pcs[1]);
+			}
+			cprintf("\n");
+		}
+	}
+
+	// Clearing races with CPUs updating the statistics, so a reset
+	// taken under load may keep a few stale counts.
+	if (reset)
+		for (lk = lockstat_list; lk; lk = lk->stat.next) {
+			st = &lk->stat;
+			st->acquires = st->contended = 0;
+			st->spin_total = st->spin_max = st->hold_total = 0;
+			memset(st->hold_hist, 0, sizeof(st->hold_hist));
+			memset(st->sites, 0, sizeof(st->sites));
+		}
+}
+#else
+void
+spin_stats_dump(bool reset)
+{
+	cprintf("Lock statistics are disabled (PROFILE_SPINLOCK)\n");
+}
 #endif
 
 void
-__spin_initlock(struct spinlock *lk, char *name)
+__spin_initlock(struct spinlock *lk, char *name, int rank, int type)
 {
 	lk->locked = 0;
+	lk->type = type;
+	lk->next_ticket = lk->now_serving = 0;
+	lk->mcs_tail = lk->mcs_owner = 0;
+#ifdef PROFILE_SPINLOCK
+	// Start the counts afresh, but leave the lock on lockstat_list,
+	// which locks are never taken off
+	memset(&lk->stat.acquires, 0,
+	       sizeof(lk->stat) - offsetof(struct lockstat, acquires));
+#endif
 #ifdef DEBUG_SPINLOCK
 	lk->name = name;
+	lk->rank = rank;
 	lk->cpu = 0;
 #endif
 }
 
+// Returns whether the lock was contended.
+static bool
+ticket_lock(struct spinlock *lk)
+{
+	unsigned ticket = xadd(&lk->next_ticket, 1);
+
+	if (lk->now_serving == ticket)
+		return 0;
+	while (lk->now_serving != ticket)
+		asm volatile ("pause");
+	return 1;
+}
+
+static void
+ticket_unlock(struct spinlock *lk)
+{
+	// Only the holder writes now_serving, but the store must not be
+	// reordered before the critical section; xchg serializes.
+	xchg(&lk->now_serving, lk->now_serving + 1);
+}
+
+// Returns whether the lock was contended.
+static bool
+mcs_lock(struct spinlock *lk)
+{
+	struct mcs_node *node, *prev;
+	int i;
+
+	for (i = 0; i < NMCSNODE; i++)
+		if (!mcs_nodes[cpunum()][i].in_use)
+			break;
+	if (i == NMCSNODE)
+		panic("CPU %d holds too many MCS locks", cpunum());
+	node = &mcs_nodes[cpunum()][i];
+	node->in_use = 1;
+	node->next = 0;
+	node->waiting = 1;
+
+	// Append ourselves to the queue; wait for our predecessor
+	// to hand the lock over.
+	prev = (struct mcs_node *) xchg((volatile uint32_t *) &lk->mcs_tail,
+					(uint32_t) node);
+	if (prev) {
+		prev->next = node;
+		while (node->waiting)
+			asm volatile ("pause");
+	}
+	lk->mcs_owner = node;
+	return prev != 0;
+}
+
+static void
+mcs_unlock(struct spinlock *lk)
+{
+	struct mcs_node *node = lk->mcs_owner;
+
+	lk->mcs_owner = 0;
+	if (!node->next) {
+		// No known successor: try to empty the queue.
+		if (cmpxchg((volatile uint32_t *) &lk->mcs_tail,
+			    (uint32_t) node, 0) == (uint32_t) node)
+			goto done;
+		// A successor is between its xchg and linking itself in.
+		while (!node->next)
+			asm volatile ("pause");
+	}
+	xchg(&node->next->waiting, 0);
+done:
+	node->in_use = 0;
+}
+
 // Acquire the lock.
 // Loops (spins) until the lock is acquired.
 // Holding a lock for a long time may cause
@@ -60,21 +383,45 @@ __spin_initlock(struct spinlock *lk, char *name)
 void
 spin_lock(struct spinlock *lk)
 {
+	bool contended = 0;
+#ifdef PROFILE_SPINLOCK
+	uint64_t t0 = read_tsc();
+#endif
+
 #ifdef DEBUG_SPINLOCK
 	if (holding(lk))
 		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
+	check_lock_order(lk);
 #endif
 
-	// The xchg is atomic.
-	// It also serializes, so that reads after acquire are not
-	// reordered before it. 
-	while (xchg(&lk->locked, 1) != 0)
-		asm volatile ("pause");
+	switch (lk->type) {
+	case SPINLOCK_TICKET:
+		contended = ticket_lock(lk);
+		lk->locked = 1;
+		break;
+	case SPINLOCK_MCS:
+		contended = mcs_lock(lk);
+		lk->locked = 1;
+		break;
+	default:
+		// The xchg is atomic.
+		// It also serializes, so that reads after acquire are not
+		// reordered before it. 
+		while (xchg(&lk->locked, 1) != 0) {
+			contended = 1;
+			asm volatile ("pause");
+		}
+	}
+
+#ifdef PROFILE_SPINLOCK
+	lockstat_acquired(lk, t0, contended, (uint32_t *) read_ebp());
+#endif
 
 	// Record info about lock acquisition for debugging.
 #ifdef DEBUG_SPINLOCK
 	lk->cpu = thiscpu;
 	get_caller_pcs(lk->pcs);
+	push_held(lk);
 #endif
 }
 
@@ -105,6 +452,11 @@ spin_unlock(struct spinlock *lk)
 
 	lk->pcs[0] = 0;
 	lk->cpu = 0;
+	pop_held(lk);
+#endif
+
+#ifdef PROFILE_SPINLOCK
+	lockstat_released(lk);
 #endif
 
 	// The xchg instruction is atomic (i.e. uses the "lock" prefix) with
@@ -113,4 +465,15 @@ spin_unlock(struct spinlock *lk)
 	// (vol 3, 8.2.2). Because xchg() is implemented using asm volatile,
 	// gcc will not reorder C statements across the xchg.
 	xchg(&lk->locked, 0);
+
+	// For queued locks 'locked' only mirrors the state for holding();
+	// hand the lock to the next waiter.
+	switch (lk->type) {
+	case SPINLOCK_TICKET:
+		ticket_unlock(lk);
+		break;
+	case SPINLOCK_MCS:
+		mcs_unlock(lk);
+		break;
+	}
 }
@@ -6,43 +6,119 @@
 // Comment this to disable spinlock debugging
 #define DEBUG_SPINLOCK
 
+// Lock contention statistics cost every acquisition a few TSC reads,
+// so they are off unless the kernel is built with LOCKSTAT=1 (see
+// GNUmakefile), which defines PROFILE_SPINLOCK.
+
+// Lock ranks, from outermost to innermost.  With DEBUG_SPINLOCK, a CPU
+// may only acquire a lock whose rank is higher than the rank of every
+// ranked lock it already holds; anything else panics as a potential
+// deadlock.  Locks with LOCK_RANK_NONE are not checked.
+enum {
+	LOCK_RANK_NONE = 0,
+	LOCK_RANK_RING,		// ring locks: system call rings (kern/ring.c)
+	LOCK_RANK_IPC,		// ipc_lock: IPC wait queues and env_ipc_* fields
+	LOCK_RANK_ENV,		// per-env locks: address space and trap frame
+	LOCK_RANK_SCHED,	// env_table_lock: env free list and env_status
+	LOCK_RANK_TIMER,	// timer wheel locks (kern/time.c)
+	LOCK_RANK_PAGE,		// page_lock: physical page free list
+	LOCK_RANK_CONS,		// cons_lock: console input and output
+};
+
+// Lock implementations, chosen per lock.  All share the spin_lock()
+// and spin_unlock() API.
+enum {
+	SPINLOCK_TAS = 0,	// test-and-set on 'locked'; cheap, unfair
+	SPINLOCK_TICKET,	// FIFO ticket lock; waiters share one line
+	SPINLOCK_MCS,		// MCS queue lock; each waiter spins locally
+};
+
+struct mcs_node;
+struct spinlock;
+
+#ifdef PROFILE_SPINLOCK
+#define LOCKSTAT_NHIST	16	// hold-time histogram buckets
+#define LOCKSTAT_HIST0	64	// upper bound of bucket 0, in cycles; each
+				// further bucket doubles it
+#define LOCKSTAT_NSITE	4	// contended call sites kept per lock
+
+// A call site that had to spin for a lock: the caller of spin_lock()
+// and its caller.
+struct lockstat_site {
+	uintptr_t pcs[2];
+	uint32_t count;		// Contended acquisitions from here
+	uint64_t spin;		// Cycles spent spinning from here
+};
+
+// Per-lock statistics.  They are only updated by the lock holder, so
+// the lock itself protects them.
+struct lockstat {
+	struct spinlock *next;	// Next lock with statistics, or 0
+	bool registered;	// On the lockstat list?
+	uint64_t acquires;	// Total acquisitions
+	uint64_t contended;	// Acquisitions that had to wait
+	uint64_t spin_total;	// Cycles spent waiting
+	uint64_t spin_max;	// Longest single wait
+	uint64_t hold_total;	// Cycles spent holding the lock
+	uint64_t hold_start;	// TSC at the current acquisition
+	uint32_t hold_hist[LOCKSTAT_NHIST];
+	struct lockstat_site sites[LOCKSTAT_NSITE];
+};
+#endif
+
 // Mutual exclusion lock.
 struct spinlock {
 	unsigned locked;       // Is the lock held?
+	int type;              // SPINLOCK_TAS, SPINLOCK_TICKET or SPINLOCK_MCS
+
+	// SPINLOCK_TICKET: next ticket to hand out, ticket being served
+	volatile unsigned next_ticket;
+	volatile unsigned now_serving;
+
+	// SPINLOCK_MCS: last waiter in the queue, and the holder's node
+	struct mcs_node *volatile mcs_tail;
+	struct mcs_node *mcs_owner;
+
+#ifdef PROFILE_SPINLOCK
+	struct lockstat stat;
+#endif
 
 #ifdef DEBUG_SPINLOCK
 	// For debugging:
 	char *name;            // Name of lock.
+	int rank;              // Position in the lock order (LOCK_RANK_*)
 	struct CpuInfo *cpu;   // The CPU holding the lock.
 	uintptr_t pcs[10];     // The call stack (an array of program counters)
 	                       // that locked the lock.
 #endif
 };
 
-void __spin_initlock(struct spinlock *lk, char *name);
+#ifdef DEBUG_SPINLOCK
+#define SPINLOCK_INITIALIZER(lkname, lkrank, lktype) \
+	{ .type = (lktype), .name = (lkname), .rank = (lkrank) }
+#else
+#define SPINLOCK_INITIALIZER(lkname, lkrank, lktype) { .type = (lktype) }
+#endif
+
+void __spin_initlock(struct spinlock *lk, char *name, int rank, int type);
 void spin_lock(struct spinlock *lk);
 void spin_unlock(struct spinlock *lk);
 
-#define spin_initlock(lock)   __spin_initlock(lock, #lock)
-
-extern struct spinlock kernel_lock;
+#define spin_initlock(lock) \
+	__spin_initlock(lock, #lock, LOCK_RANK_NONE, SPINLOCK_TAS)
 
-static inline void
-lock_kernel(void)
-{
-	spin_lock(&kernel_lock);
-}
+// Print the most contended locks, with hold-time histograms and their
+// top contended call sites.  If reset is set, clear the statistics.
+void spin_stats_dump(bool reset);
 
-static inline void
-unlock_kernel(void)
-{
-	spin_unlock(&kernel_lock);
+// Contention microbenchmark (kern/lockbench.c); run by every CPU at
+// boot when the kernel is built with -DBENCH_SPINLOCK.
+void spinlock_bench(void);
 
-	// Normally we wouldn't need to do this, but QEMU only runs
-	// one CPU at a time and has a long time-slice.  Without the
-	// pause, this CPU is likely to reacquire the lock before
-	// another CPU has even been given a chance to acquire it.
-	asm volatile("pause");
-}
+// The kernel's locks, in lock order.  Per-env locks live in kern/env.c.
+extern struct spinlock ipc_lock;
+extern struct spinlock env_table_lock;
+extern struct spinlock page_lock;
+extern struct spinlock cons_lock;
 
 #endif
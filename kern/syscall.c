@@ -11,21 +11,36 @@
 #include <kern/syscall.h>
 #include <kern/console.h>
 #include <kern/sched.h>
+#include <kern/spinlock.h>
+#include <kern/time.h>
+#include <kern/fpu.h>
+#include <kern/ring.h>
+#include <kern/region.h>
+#include <kern/shlib.h>
+
+// Protects every env's IPC queue and env_ipc_* fields.
+struct spinlock ipc_lock = SPINLOCK_INITIALIZER("ipc_lock", LOCK_RANK_IPC, SPINLOCK_TICKET);
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
 // Destroys the environment on memory errors.
-static void
+// Returns 0, or -E_PAGEIN if the string must be paged in first (see
+// user_arg_check()).
+static int
 sys_cputs(const char *s, size_t len)
 {
+	int r;
+
 	// Check that the user has permission to read memory [s, s+len).
 	// Destroy the environment if not.
 
 	// LAB 3: Your code here.
-	user_mem_assert(curenv, s, len, 0);
+	if ((r = user_arg_assert(curenv, s, len, 0)) < 0)
+		return r;
 
 	// Print the string supplied by the user.
 	cprintf("%.*s", len, s);
+	return 0;
 }
 
 // Read a character from the system console without blocking.
@@ -36,6 +51,25 @@ sys_cgetc(void)
 	return cons_getc();
 }
 
+// Read a character from the system console, sleeping until one arrives.
+// Returns the character, or 0 if woken without input for this env;
+// the caller should simply try again.
+static int
+sys_cgetc_wait(void)
+{
+	int c;
+
+	// The input interrupts fill the buffer before waking cons_wq,
+	// and that takes env_table_lock, so checking the buffer under
+	// it cannot miss a wakeup.
+	spin_lock(&env_table_lock);
+	if ((c = cons_getc()) != 0) {
+		spin_unlock(&env_table_lock);
+		return c;
+	}
+	wq_sleep(&cons_wq, &env_table_lock, 0);
+}
+
 // Returns the current environment's envid.
 static envid_t
 sys_getenvid(void)
@@ -60,6 +94,29 @@ sys_env_destroy(envid_t envid)
 	return 0;
 }
 
+// Sleep until environment 'envid' has exited.
+// Returns 0 once it has.
+// Returns -E_INVAL if envid is the current environment.
+static int
+sys_env_wait(envid_t envid)
+{
+	struct Env *e = &envs[ENVX(envid)];
+
+	if (envid == 0 || envid == curenv->env_id)
+		return -E_INVAL;
+
+	spin_lock(&env_table_lock);
+	if (e->env_id != envid || e->env_status == ENV_FREE) {
+		spin_unlock(&env_table_lock);
+		return 0;
+	}
+	wq_sleep_key(&env_exit_wq, envid, &env_table_lock, 0);
+}
+
+static void futex_wake_page(physaddr_t pa);
+static void sys_yield(void) __attribute__((noreturn));
+static void sys_yield_to(envid_t envid) __attribute__((noreturn));
+
 // Deschedule current environment and pick a different one to run.
 static void
 sys_yield(void)
@@ -67,6 +124,15 @@ sys_yield(void)
 	sched_yield();
 }
 
+// Donate the rest of the caller's time slice to env 'envid', so that
+// an env waiting on a known partner can let it run at once.  Falls
+// back to sys_yield() unless envid is runnable and may run on this CPU.
+static void
+sys_yield_to(envid_t envid)
+{
+	sched_yield_to(envid);
+}
+
 // Allocate a new environment.
 // Returns envid of new environment, or < 0 on error.  Errors are:
 //	-E_NO_FREE_ENV if no free environment is available.
@@ -84,20 +150,173 @@ sys_exofork(void)
 	int retval;
 	struct Env *child;
 
+	// env_alloc leaves the child ENV_NOT_RUNNABLE
 	if ((retval = env_alloc(&child, curenv->env_id)))
 	{
 		return retval;
 	}
 
-	child->env_status = ENV_NOT_RUNNABLE;
 	child->env_tf = curenv->env_tf;
 	child->env_tf.tf_regs.reg_eax = 0;
+	child->env_cpumask = curenv->env_cpumask;
+	fpu_fork(child);
 
 	return child->env_id;
 
 	// panic("sys_exofork not implemented");
 }
 
+// Create a runnable child that is a copy of the current environment:
+// the same registers, except that sys_fork returns 0 in it, and a
+// copy-on-write copy of the address space below UTOP, made in one pass
+// here instead of a system call or two per page.  PTE_SHARE pages stay
+// shared.  The child inherits the page fault upcall and, if the parent
+// has a user exception stack, gets a fresh one of its own, since the
+// kernel never writes through a copy-on-write mapping when pushing a
+// UTrapframe.
+//
+// Returns envid of new environment, or < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_fork(void)
+{
+	struct Env *child;
+	struct PageInfo *p;
+	void *xstack = (void *) (UXSTACKTOP - PGSIZE);
+	int retval;
+
+	if ((retval = env_alloc(&child, curenv->env_id)))
+		return retval;
+	child->env_tf = curenv->env_tf;
+	child->env_tf.tf_regs.reg_eax = 0;
+	child->env_cpumask = curenv->env_cpumask;
+	child->env_pgfault_upcall = curenv->env_pgfault_upcall;
+	fpu_fork(child);
+
+	// Nobody else can get at the child before it is runnable, so
+	// only the parent's lock is needed
+	lock_env(curenv);
+	region_fork(child);
+	retval = pgdir_copy(child->env_pgdir, curenv->env_pgdir,
+			    (uintptr_t) xstack, false);
+	if (retval == 0 && page_lookup(curenv->env_pgdir, xstack, NULL)) {
+		if (!(p = page_alloc(ALLOC_ZERO)))
+			retval = -E_NO_MEM;
+		else if ((retval = page_insert(child->env_pgdir, p, xstack,
+					       PTE_P | PTE_U | PTE_W)))
+			page_free(p);
+	}
+	unlock_env(curenv);
+	if (retval) {
+		env_destroy(child);
+		return retval;
+	}
+
+	spin_lock(&env_table_lock);
+	sched_set_status(child, ENV_RUNNABLE);
+	spin_unlock(&env_table_lock);
+	return child->env_id;
+}
+
+// Load the program in the ELF image mapped at 'image', 'len' bytes of
+// it, into envid, a child made by sys_exofork that has not run yet, in
+// one pass: its segments, with read-only pages shared with the image
+// and BSS left demand-zero, libjos (see kern/shlib.c), the USTACKSIZE
+// stack region below its first stack page, which the caller maps, the
+// caller's PTE_SHARE pages, and its entry point as its eip.  The
+// caller maps the image, page-aligned, typically with read_map() of
+// the program file.  Pages of segment data it leaves out are not
+// mapped in envid, whose own page fault handler then has to load them
+// (see lib/pager.c).
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if envid is the caller or has been made runnable.
+//	-E_INVAL if image is not page-aligned.
+//	-E_NOT_EXEC if the image is not a valid ELF executable.
+//	-E_FAULT if the caller cannot read the ELF headers.
+//	-E_NO_MEM on memory exhaustion.
+//	On error, envid may have been loaded in part.
+static int
+sys_exec(envid_t envid, const void *image, size_t len)
+{
+	struct Env *e;
+	uintptr_t entry;
+	int retval;
+
+	if ((retval = envid2env(envid, &e, true)))
+		return retval;
+	if (e == curenv || e->env_status != ENV_NOT_RUNNABLE || e->env_runs)
+		return -E_INVAL;
+	if (PGOFF(image) || (uintptr_t) image >= UTOP)
+		return -E_INVAL;
+
+	// As in sys_fork, e is the caller's to set up alone, so its lock
+	// is not needed
+	if ((retval = env_load_elf(e, image, MIN(len, UTOP - (uintptr_t) image),
+				   curenv, &entry)) ||
+	    (retval = shlib_map(e)) ||
+	    (retval = region_reserve(e, USTACKTOP - USTACKSIZE,
+				     USTACKSIZE - PGSIZE, PTE_P | PTE_U | PTE_W)))
+		return retval;
+
+	lock_env(curenv);
+	retval = pgdir_copy(e->env_pgdir, curenv->env_pgdir, UTOP, true);
+	unlock_env(curenv);
+	if (retval == 0)
+		e->env_tf.tf_eip = entry;
+	return retval;
+}
+
+// Reserve [va, va+len) in envid's address space as demand-zero memory:
+// the first access to each page there maps a zeroed page with
+// permission 'perm', without a user-level page fault handler.  perm is
+// as in sys_page_alloc, and len is rounded up to a multiple of PGSIZE.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va is not page-aligned, len is 0, or va+len > UTOP.
+//	-E_INVAL if perm is inappropriate (see sys_page_alloc).
+//	-E_INVAL if the range overlaps a region envid has reserved.
+//	-E_NO_MEM if envid has NREGION regions already.
+static int
+sys_region_reserve(envid_t envid, void *va, size_t len, int perm)
+{
+	struct Env *e;
+	int retval;
+
+	if ((retval = envid2env_lock(envid, &e, true)))
+		return retval;
+	retval = region_reserve(e, (uintptr_t) va, len, perm);
+	unlock_env(e);
+	return retval;
+}
+
+// Set envid's fault-around window: a copy-on-write or demand-zero fault
+// also maps the other pages of the aligned window of 'npages' pages
+// around the faulting one that would fault the same way.  1 turns
+// fault-around off.  env_faults_avoided counts the pages mapped ahead.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if npages is not a power of 2 up to FAULTAROUND_MAX.
+static int
+sys_env_set_faultaround(envid_t envid, int npages)
+{
+	struct Env *e;
+	int retval;
+
+	if ((retval = envid2env_lock(envid, &e, true)))
+		return retval;
+	retval = region_set_faultaround(e, npages);
+	unlock_env(e);
+	return retval;
+}
+
 // Set envid's env_status to status, which must be ENV_RUNNABLE
 // or ENV_NOT_RUNNABLE.
 //
@@ -128,13 +347,55 @@ sys_env_set_status(envid_t envid, int status)
 		return retval; 
 	}
 
-	e->env_status = status;
+	spin_lock(&env_table_lock);
+	if (e->env_id != envid && envid != 0)
+		retval = -E_BAD_ENV;
+	else if (e->env_status == ENV_RUNNABLE || e->env_status == ENV_NOT_RUNNABLE)
+		sched_set_status(e, status);
+	// a running env stays running; a dying one stays dying
+	spin_unlock(&env_table_lock);
 
-	return 0;
+	return retval;
 
 	// panic("sys_env_set_status not implemented");
 }
 
+// Restrict envid to the CPUs in 'cpumask' (bit n: CPU n); bits for
+// CPUs that do not exist are ignored.  If the caller restricts itself
+// away from the current CPU, it moves before this call returns.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if cpumask contains no existing CPU.
+static int
+sys_env_set_affinity(envid_t envid, uint32_t cpumask)
+{
+	struct Env *e;
+	int r;
+
+	if (ncpu < 32)
+		cpumask &= (1U << ncpu) - 1;
+	if (cpumask == 0)
+		return -E_INVAL;
+	if ((r = envid2env(envid, &e, true)) < 0)
+		return r;
+
+	spin_lock(&env_table_lock);
+	if (e->env_id != envid && envid != 0) {
+		spin_unlock(&env_table_lock);
+		return -E_BAD_ENV;
+	}
+	sched_set_affinity(e, cpumask);
+	spin_unlock(&env_table_lock);
+	// The scheduler moves curenv off a CPU it may no longer use
+	if (e == curenv && !(cpumask & (1 << cpunum()))) {
+		curenv->env_tf.tf_regs.reg_eax = 0;
+		sched_yield();
+	}
+	return 0;
+}
+
 // Set envid's trap frame to 'tf'.
 // tf is modified to make sure that user environments always run at code
 // protection level 3 (CPL 3), interrupts enabled, and IOPL of 0.
@@ -142,6 +403,7 @@ sys_env_set_status(envid_t envid, int status)
 // Returns 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
+//	-E_PAGEIN if tf must be paged in first (see user_arg_check()).
 static int
 sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 {
@@ -153,15 +415,17 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 	struct Env *e;
 	int r;
 
-	if ((r = envid2env(envid, &e, true)) < 0)
+	if ((r = user_arg_assert(curenv, tf, sizeof(struct Trapframe), 0)) < 0)
+		return r;
+
+	if ((r = envid2env_lock(envid, &e, true)) < 0)
 		return r;
-	
-	user_mem_assert(curenv, tf, sizeof(struct Trapframe), 0);
 	e->env_tf = *tf;
 	
 	e->env_tf.tf_cs |= 3;
 	e->env_tf.tf_eflags |= FL_IF;
 	e->env_tf.tf_eflags &= ~FL_IOPL_MASK;
+	unlock_env(e);
 
 	return 0;
 }
@@ -233,27 +497,64 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	struct PageInfo *p;
 	int retval;
 
-	if ((retval = envid2env(envid, &e, true)))
-	{
-		return retval;
-	}
-
 	p = page_alloc(ALLOC_ZERO);
 	if (p == NULL)
 	{
 		return -E_NO_MEM;
 	}
+	if ((retval = envid2env_lock(envid, &e, true)))
+	{
+		page_free(p);
+		return retval;
+	}
 	if ((retval = page_insert(e->env_pgdir, p, va, perm)))
 	{
+		unlock_env(e);
 		page_free(p);
 		return -E_NO_MEM;
 	}
+	unlock_env(e);
 
 	return 0;
 
 	// panic("sys_page_alloc not implemented");
 }
 
+// Look up the page mapped at 'va' in e's address space and take a
+// reference to it, so that it stays allocated after e's lock is dropped.
+// The caller must page_decref() it when done.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if e has been freed.
+//	-E_INVAL if va is not mapped in e's address space.
+//	-E_INVAL if (perm & PTE_W), but va is read-only in e's address space.
+//	-E_PAGEIN if e is curenv and va must be paged in first (see
+//		user_arg_check()).
+static int
+pin_user_page(struct Env *e, void *va, int perm, struct PageInfo **pp_store)
+{
+	struct PageInfo *p = NULL;
+	pte_t *pte;
+	int r = 0;
+
+	lock_env(e);
+	if (e->env_status == ENV_FREE)
+		r = -E_BAD_ENV;
+	else if ((p = page_lookup(e->env_pgdir, va, &pte)) == NULL)
+		r = -E_INVAL;
+	else if ((perm & PTE_W) && (~(*pte) & PTE_W))
+		r = -E_INVAL;
+	else
+		page_incref(p);
+	unlock_env(e);
+
+	if (r == 0)
+		*pp_store = p;
+	else if (p == NULL && e == curenv && user_mem_pagein(e, va) < 0)
+		r = -E_PAGEIN;
+	return r;
+}
+
 // Map the page of memory at 'srcva' in srcenvid's address space
 // at 'dstva' in dstenvid's address space with permission 'perm'.
 // Perm has the same restrictions as in sys_page_alloc, except
@@ -270,6 +571,8 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in srcenvid's
 //		address space.
 //	-E_NO_MEM if there's no memory to allocate any necessary page tables.
+//	-E_PAGEIN if srcenvid is the caller and srcva must be paged in
+//		first (see user_arg_check()).
 static int
 sys_page_map(envid_t srcenvid, void *srcva,
 	     envid_t dstenvid, void *dstva, int perm)
@@ -304,33 +607,34 @@ sys_page_map(envid_t srcenvid, void *srcva,
 	{
 		return -E_INVAL;
 	}
-
-	p = page_lookup(srce->env_pgdir, srcva, &pte);
-	if (p == NULL)
-	{
-		return -E_INVAL;
-	}
 	if ((~perm & PTE_P) || (~perm & PTE_U) || (perm & ~PTE_SYSCALL))
 	{
 		return -E_INVAL;
 	}
-	if ((perm & PTE_W) && (~(*pte) & PTE_W))
-	{
-		return -E_INVAL;
-	}
 
-	if ((retval = page_insert(dste->env_pgdir, p, dstva, perm)))
+	// Only one env lock is held at a time: pin the source page with
+	// a reference so it survives until it is mapped in dstenv.
+	if ((retval = pin_user_page(srce, srcva, perm, &p)))
 	{
 		return retval;
 	}
+	if ((retval = envid2env_lock(dstenvid, &dste, true)) == 0)
+	{
+		retval = page_insert(dste->env_pgdir, p, dstva, perm);
+		unlock_env(dste);
+	}
+	page_decref(p);
 
-	return 0;
+	return retval;
 
 	// panic("sys_page_map not implemented");
 }
 
 // Unmap the page of memory at 'va' in the address space of 'envid'.
-// If no page is mapped, the function silently succeeds.
+// If no page is mapped, the function silently succeeds.  Unmapping a
+// PTE_SHARE page that other envs still map wakes the envs asleep on a
+// futex in it, so that one waiting for the page to be unmapped (as a
+// pipe's reader waits for its writers to go) need not poll.
 //
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
@@ -343,78 +647,70 @@ sys_page_unmap(envid_t envid, void *va)
 
 	// LAB 4: Your code here.
 	struct Env *e;
+	struct PageInfo *pp;
+	pte_t *pte;
+	physaddr_t shared = 0;
 	int retval;
 
-	if ((retval = envid2env(envid, &e, true)))
-	{
-		return retval;
-	}
 	if ((intptr_t)(va) >= UTOP || (intptr_t)(va) % PGSIZE)
 	{
 		return -E_INVAL;
 	}
+	if ((retval = envid2env_lock(envid, &e, true)))
+	{
+		return retval;
+	}
 
+	if ((pp = page_lookup(e->env_pgdir, va, &pte)) &&
+	    (*pte & PTE_SHARE) && pp->pp_ref > 1)
+		shared = page2pa(pp);
 	page_remove(e->env_pgdir, va);
+	unlock_env(e);
+	if (shared)
+		futex_wake_page(shared);
 
 	return 0;
 
 	// panic("sys_page_unmap not implemented");
 }
 
-// handle the IPC to dst from src (the head of dst's waiting queue)
-// contains much of the original version of sys_ipc_try_send()
-// can be called both from the sender or the receiver when
-// (1) receiver calls sys_ipc_recv() when some environments are waiting to send
-// (2) sender calls sys_ipc_try_send() when the receiver is ready to receiver 
-// see sys_ipc_try_send() for possible errors and more information
-static int 
-handle_ipc(struct Env* dst)
+// Transfer 'value', and the page at 'srcva' if both sides want one,
+// from src to dst, which is waiting in sys_ipc_recv().  See
+// sys_ipc_try_send() for possible errors.
+// The caller must hold ipc_lock.
+static int
+ipc_transfer(struct Env *src, struct Env *dst, uint32_t value,
+	     void *srcva, int perm)
 {
 	int r;
 
-	// pop the front of the waiting queue
-	struct Env* src = dst->env_ipc_queue;
-	assert(src != NULL);
-	dst->env_ipc_queue = src->env_ipc_next;
-
-	// restore the arguments from IPC relevant field
-	void *srcva = src->env_ipc_dstva;
-	uint32_t value = src->env_ipc_value;
-	int perm = src->env_ipc_perm;
-
 	// only tries to transfer a page when they're both willing
 	if ((intptr_t)(srcva) < UTOP && (intptr_t)(dst->env_ipc_dstva) < UTOP)
 	{
 		if ((intptr_t)(srcva) % PGSIZE)
 		{
-			r = -E_INVAL;
-			goto ret;
+			return -E_INVAL;
 		}
 		if ((~perm & PTE_P) || (~perm & PTE_U) || (perm & ~PTE_SYSCALL))
 		{
-			r = -E_INVAL;
-			goto ret;
+			return -E_INVAL;
 		}
 
 		// we don't call sys_page_map() to do this since it
 		// have more strict permisson request
 		struct PageInfo* p;
-		pte_t *pte;
-		p = page_lookup(src->env_pgdir, srcva, &pte);
-		if (p == NULL)
+		if ((r = pin_user_page(src, srcva, perm, &p)))
 		{
 			// cprintf("handle_ipc: try to send non-existent page %p\n", srcva);
-			r = -E_INVAL;
-			goto ret;
-		}
-		if ((perm & PTE_W) && (~(*pte) & PTE_W))
-		{
-			r = -E_INVAL;
-			goto ret;
+			return r;
 		}
-		if ((r = page_insert(dst->env_pgdir, p, dst->env_ipc_dstva, perm)))
+		lock_env(dst);
+		r = page_insert(dst->env_pgdir, p, dst->env_ipc_dstva, perm);
+		unlock_env(dst);
+		page_decref(p);
+		if (r)
 		{
-			goto ret;
+			return r;
 		}	
 	}
 	else // now all checks have been passed at this position
@@ -426,21 +722,61 @@ handle_ipc(struct Env* dst)
 	dst->env_ipc_from = src->env_id;
 	dst->env_ipc_value = value;
 	dst->env_ipc_perm = perm;
+	return 0;
+}
+
+// Find the first sender queued on dst that dst will receive from: any,
+// unless dst is receiving from one env only (sys_ipc_recv_from).  The
+// caller must hold ipc_lock.
+static struct Env **
+ipc_find_sender(struct Env *dst)
+{
+	struct Env **pp;
+
+	for (pp = &dst->env_ipc_queue; *pp; pp = &(*pp)->env_ipc_next)
+		if (!dst->env_ipc_recv_from ||
+		    (*pp)->env_id == dst->env_ipc_recv_from)
+			break;
+	return pp;
+}
+
+// handle the IPC to dst from src (the first sender in dst's waiting queue
+// that dst receives from, see ipc_find_sender())
+// contains much of the original version of sys_ipc_try_send()
+// can be called both from the sender or the receiver when
+// (1) receiver calls sys_ipc_recv() when some environments are waiting to send
+// (2) sender calls sys_ipc_try_send() when the receiver is ready to receiver 
+// see sys_ipc_try_send() for possible errors and more information
+// The caller must hold ipc_lock.
+static int 
+handle_ipc(struct Env* dst)
+{
+	int r;
+
+	// pop the sender from the waiting queue
+	struct Env **pp = ipc_find_sender(dst);
+	struct Env* src = *pp;
+	assert(src != NULL);
+	*pp = src->env_ipc_next;
+
+	// restore the arguments from IPC relevant field
+	r = ipc_transfer(src, dst, src->env_ipc_value, src->env_ipc_dstva,
+			 src->env_ipc_perm);
 
-	r = 0;
-ret:
 	// store return value in sender's or receiver's %eax 
 	// in case they're sleeping
+	spin_lock(&env_table_lock);
 	if (src->env_status == ENV_NOT_RUNNABLE)
 	{
-		src->env_status = ENV_RUNNABLE;
+		sched_set_status(src, ENV_RUNNABLE);
 		src->env_tf.tf_regs.reg_eax = r;
 	}
 	if (dst->env_status == ENV_NOT_RUNNABLE && !r) // receiver only wake up on success
 	{
-		dst->env_status = ENV_RUNNABLE;
+		sched_set_status(dst, ENV_RUNNABLE);
 		dst->env_tf.tf_regs.reg_eax = r;
 	}
+	spin_unlock(&env_table_lock);
 	// cprintf("handl_ipc(): from %x to %x, value = %d, retval = %d\n", 
 	// 		src->env_id, dst->env_id, value, r);
 	return r;
@@ -484,6 +820,7 @@ ret:
 //		current environment's address space.
 //	-E_NO_MEM if there's not enough memory to map srcva in envid's
 //		address space.
+//	-E_PAGEIN if srcva must be paged in first (see user_arg_check()).
 static int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 {
@@ -495,6 +832,21 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 	{
 		return r;
 	}
+	// The page is taken from us when the receiver is ready, which may
+	// be after we block; page it in now
+	if ((uintptr_t) srcva < UTOP && (r = user_mem_pagein(curenv, srcva)) < 0)
+	{
+		return r;
+	}
+
+	spin_lock(&ipc_lock);
+	// the receiver may have died since we looked it up;
+	// ipc_env_free() drains the queue of a dying env under ipc_lock
+	if (e->env_id != envid || e->env_status == ENV_DYING || e->env_status == ENV_FREE)
+	{
+		spin_unlock(&ipc_lock);
+		return -E_BAD_ENV;
+	}
 
 	// add current environment to the head of waiting queue of receiving environemnt
 	curenv->env_ipc_next = e->env_ipc_queue;
@@ -504,21 +856,89 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 	curenv->env_ipc_dstva = srcva;
 	curenv->env_ipc_perm = perm;
 
-	if(!e->env_ipc_recving)
+	if(!e->env_ipc_recving || *ipc_find_sender(e) != curenv)
 	{
 		// return -E_IPC_NOT_RECV;
 		
 		// give up CPU if receiver isn't ready 
 		// instead of return -E_IPC_NOT_RECV
-		curenv->env_status = ENV_NOT_RUNNABLE;
-		sched_yield();
+		sched_sleep(&ipc_lock);
 	}
 	// otherwise do the IPC
-	return handle_ipc(e);
+	r = handle_ipc(e);
+	spin_unlock(&ipc_lock);
+	return r;
 
 	// panic("sys_ipc_try_send not implemented");
 }
 
+// Send to 'envid' on behalf of src without blocking: the send only
+// happens if the target is waiting in sys_ipc_recv() with no other
+// sender queued.  Returns -E_IPC_NOT_RECV otherwise, or an error from
+// sys_ipc_try_send().
+int
+ipc_send_nowait(struct Env *src, envid_t envid, uint32_t value,
+		void *srcva, unsigned perm)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = envid2env(envid, &e, false)))
+		return r;
+
+	spin_lock(&ipc_lock);
+	if (e->env_id != envid || e->env_status == ENV_DYING || e->env_status == ENV_FREE)
+		r = -E_BAD_ENV;
+	else if (!e->env_ipc_recving || e->env_ipc_queue ||
+		 (e->env_ipc_recv_from && e->env_ipc_recv_from != src->env_id))
+		r = -E_IPC_NOT_RECV;
+	else if ((r = ipc_transfer(src, e, value, srcva, perm)) == 0) {
+		spin_lock(&env_table_lock);
+		if (e->env_status == ENV_NOT_RUNNABLE) {
+			sched_set_status(e, ENV_RUNNABLE);
+			e->env_tf.tf_regs.reg_eax = 0;
+		}
+		spin_unlock(&env_table_lock);
+	}
+	spin_unlock(&ipc_lock);
+	return r;
+}
+
+// Receive as sys_ipc_recv does, but only from env 'from', or from any
+// env if it is 0.  Other senders stay queued for a later receive.
+static int
+sys_ipc_recv_from(envid_t from, void *dstva)
+{
+	int r;
+
+	if ((intptr_t)(dstva) < UTOP && (intptr_t)(dstva) % PGSIZE)
+	{
+		return -E_INVAL;
+	}
+	spin_lock(&ipc_lock);
+	curenv->env_ipc_recving = true;
+	curenv->env_ipc_dstva = dstva;
+	curenv->env_ipc_recv_from = from;
+
+	// travel IPC waiting queue (loop because some might fail)
+	while (*ipc_find_sender(curenv) != NULL)
+	{
+		r = handle_ipc(curenv);
+		if (!r)
+		{
+			spin_unlock(&ipc_lock);
+			return r;
+		}
+	}
+
+	// no valid waiting environment, give up the CPU
+	sched_sleep(&ipc_lock);
+
+	// panic("sys_ipc_recv not implemented");
+
+	return 0; // the function actually doesn't return here
+}
+
 // Block until a value is ready.  Record that you want to receive
 // using the env_ipc_recving and env_ipc_dstva fields of struct Env,
 // mark yourself not runnable, and then give up the CPU.
@@ -534,29 +954,241 @@ static int
 sys_ipc_recv(void *dstva)
 {
 	// LAB 4: Your code here.
-	int r;
+	return sys_ipc_recv_from(0, dstva);
+}
 
-	if ((intptr_t)(dstva) < UTOP && (intptr_t)(dstva) % PGSIZE)
-	{
+// Futex wait queues.  A futex is keyed by the physical address of the
+// word, so every env sharing the page (e.g. through a PTE_SHARE
+// mapping) finds the same waiters.  Keys are hashed by page, so that
+// the waiters on all the words of a page share a queue.
+#define NFUTEXHASH	64
+static struct waitqueue futex_wq[NFUTEXHASH];
+
+static struct waitqueue *
+futex_queue(physaddr_t key)
+{
+	return &futex_wq[PGNUM(key) % NFUTEXHASH];
+}
+
+// Wake every env asleep on a futex in the physical page at 'pa'.
+static void
+futex_wake_page(physaddr_t pa)
+{
+	wq_wakeup_range(futex_queue(pa), pa, pa + PGSIZE, -1, 0);
+}
+
+// Find the futex key for the 32-bit word at user address 'addr' in
+// curenv, and the word's kernel address.  The caller must hold
+// curenv's lock, which keeps the page mapped.
+// Returns 0 on success, -E_INVAL if addr is misaligned, above UTOP or
+// not mapped user-accessible.
+static int
+futex_lookup(const uint32_t *addr, physaddr_t *key_store,
+	     volatile uint32_t **kva_store)
+{
+	struct PageInfo *p;
+	pte_t *pte;
+
+	if ((uintptr_t) addr >= UTOP || (uintptr_t) addr % sizeof(uint32_t))
 		return -E_INVAL;
+	if ((p = page_lookup(curenv->env_pgdir, (void *) addr, &pte)) == NULL ||
+	    !(*pte & PTE_U))
+		return -E_INVAL;
+	*key_store = page2pa(p) + PGOFF(addr);
+	*kva_store = (volatile uint32_t *) (page2kva(p) + PGOFF(addr));
+	return 0;
+}
+
+// Sleep until another env calls sys_futex_wake() on the same word,
+// provided the 32-bit word at 'addr' still holds 'expected'.
+// 'timeout' is in microseconds; 0 waits forever.
+//
+// Returns 0 when woken, or at once if *addr != expected.  Callers
+// should re-check their condition either way.
+// Errors are:
+//	-E_INVAL if addr is not a mapped, 4-byte aligned user address.
+//	-E_PAGEIN if addr must be paged in first (see user_arg_check()).
+//	-E_TIMEOUT if 'timeout' microseconds pass without a wakeup.
+static int
+sys_futex_wait(const uint32_t *addr, uint32_t expected, uint32_t timeout)
+{
+	volatile uint32_t *kva;
+	physaddr_t key;
+	uint32_t val;
+	int r;
+
+	lock_env(curenv);
+	if ((r = futex_lookup(addr, &key, &kva)) < 0) {
+		unlock_env(curenv);
+		return user_mem_pagein(curenv, addr) < 0 ? -E_PAGEIN : r;
 	}
-	curenv->env_ipc_recving = true;
-	curenv->env_ipc_dstva = dstva;
+	// Read the word under env_table_lock: a waker changes it before
+	// taking env_table_lock in sys_futex_wake(), so the wakeup cannot
+	// fall between the check and the sleep.
+	spin_lock(&env_table_lock);
+	val = *kva;
+	unlock_env(curenv);
+	if (val != expected) {
+		spin_unlock(&env_table_lock);
+		return 0;
+	}
+	wq_sleep_key(futex_queue(key), key, &env_table_lock, timeout);
+}
 
-	// travel IPC waiting queue (loop because some might fail)
-	while (curenv->env_ipc_queue != NULL)
-	{
-		r = handle_ipc(curenv);
-		if (!r) return r;
+// Wake up to 'n' envs (all of them if n < 0) sleeping in
+// sys_futex_wait() on the word at 'addr'.
+// Returns the number of envs woken, -E_INVAL if addr is not a mapped,
+// 4-byte aligned user address, or -E_PAGEIN if it must be paged in
+// first (see user_arg_check()).
+static int
+sys_futex_wake(const uint32_t *addr, int n)
+{
+	volatile uint32_t *kva;
+	physaddr_t key;
+	int r;
+
+	lock_env(curenv);
+	r = futex_lookup(addr, &key, &kva);
+	unlock_env(curenv);
+	if (r < 0)
+		return user_mem_pagein(curenv, addr) < 0 ? -E_PAGEIN : r;
+	return wq_wakeup_key(futex_queue(key), key, n, 0);
+}
+
+// Sleep for at least 'usec' microseconds.  The env is off every run
+// queue until its timer fires.  Returns 0.
+static int
+sys_sleep(uint32_t usec)
+{
+	if (usec == 0)
+		return 0;
+	wq_sleep(NULL, NULL, usec);
+}
+
+// Return the microseconds since boot, from the TSC.  The result is
+// 64 bits wide: the high half is returned in %edx.
+static int
+sys_time(void)
+{
+	uint64_t now = time_usec();
+
+	curenv->env_tf.tf_regs.reg_edx = now >> 32;
+	return (uint32_t) now;
+}
+
+// Descriptors sys_batch() copies in at a time
+#define BATCH_CHUNK	16
+
+// Make the n system calls described by calls[] in order, storing each
+// one's result in its sc_ret.  With BATCH_STOPONERR, stop after the
+// first one that fails.  Only calls that return to the batch at once,
+// with nothing but their result, may be batched: the others, which may
+// block, yield, not return or return more than %eax, fail with
+// -E_INVAL.  The calls may unmap calls[] itself, so it is copied in and
+// the results out a chunk at a time, checking the memory every time.
+// A batch also stops before a call, or a chunk of calls[], that must be
+// paged in first (see user_arg_check()), leaving it not made; the stub
+// in lib/syscall.c then goes on from there.
+// Returns the number of calls made, -E_FAULT if calls[] cannot be read
+// or written, or -E_PAGEIN if it must be paged in before any call.
+static int
+sys_batch(struct Syscall *calls, int n, int flags)
+{
+	struct Syscall chunk[BATCH_CHUNK];
+	int i, j, m, done, r;
+
+	if (n < 0 || (flags & ~BATCH_STOPONERR))
+		return -E_INVAL;
+
+	for (done = 0; done < n; done += m) {
+		m = MIN(n - done, BATCH_CHUNK);
+		if ((r = user_arg_check(curenv, calls + done,
+					m * sizeof(*calls), PTE_W)) < 0)
+			return (r == -E_PAGEIN && done > 0) ? done : r;
+		memcpy(chunk, calls + done, m * sizeof(*calls));
+
+		for (j = 0; j < m; j++) {
+			struct Syscall *sc = &chunk[j];
+
+			switch (sc->sc_num) {
+			case SYS_cputs:
+			case SYS_cgetc:
+			case SYS_getenvid:
+			case SYS_page_alloc:
+			case SYS_page_map:
+			case SYS_page_unmap:
+			case SYS_env_set_status:
+			case SYS_env_set_pgfault_upcall:
+			case SYS_futex_wake:
+			case SYS_ring_setup:
+			case SYS_region_reserve:
+			case SYS_env_set_faultaround:
+			case SYS_exec:
+				sc->sc_ret = syscall(sc->sc_num, sc->sc_args[0],
+						     sc->sc_args[1], sc->sc_args[2],
+						     sc->sc_args[3], sc->sc_args[4]);
+				break;
+			default:
+				sc->sc_ret = -E_INVAL;
+			}
+			if (sc->sc_ret == -E_PAGEIN) {
+				m = j;
+				n = done + m;
+				break;
+			}
+			if (sc->sc_ret < 0 && (flags & BATCH_STOPONERR)) {
+				m = j + 1;
+				n = done + m;
+				break;
+			}
+		}
+
+		if (user_mem_check(curenv, calls + done, m * sizeof(*calls),
+				   PTE_U | PTE_W) < 0)
+			return -E_FAULT;
+		for (i = 0; i < m; i++)
+			calls[done + i].sc_ret = chunk[i].sc_ret;
 	}
+	return done;
+}
 
-	// no valid waiting environment, give up the CPU
-	curenv->env_status = ENV_NOT_RUNNABLE;
-	sched_yield();
+// Called by env_reap_later() before 'e' is torn down: wake every sender
+// still queued on 'e' with -E_BAD_ENV and take 'e' out of the queue it
+// is itself waiting in, so no IPC can reach a freed env.
+void
+ipc_env_free(struct Env *e)
+{
+	struct Env *src, **pp;
+	int i;
 
-	// panic("sys_ipc_recv not implemented");
+	spin_lock(&ipc_lock);
+	e->env_ipc_recving = 0;
 
-	return 0; // the function actually doesn't return here
+	spin_lock(&env_table_lock);
+	while ((src = e->env_ipc_queue) != NULL)
+	{
+		e->env_ipc_queue = src->env_ipc_next;
+		if (src->env_status == ENV_NOT_RUNNABLE)
+		{
+			sched_set_status(src, ENV_RUNNABLE);
+			src->env_tf.tf_regs.reg_eax = -E_BAD_ENV;
+		}
+	}
+	spin_unlock(&env_table_lock);
+
+	for (i = 0; i < NENV; i++)
+	{
+		for (pp = &envs[i].env_ipc_queue; *pp != NULL; pp = &(*pp)->env_ipc_next)
+		{
+			if (*pp == e)
+			{
+				*pp = e->env_ipc_next;
+				break;
+			}
+		}
+	}
+	e->env_ipc_next = NULL;
+	spin_unlock(&ipc_lock);
 }
 
 // Dispatches to the correct kernel function, passing the arguments.
@@ -571,8 +1203,7 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 
 	switch (syscallno) {
 	case SYS_cputs:
-		sys_cputs((char *)a1, a2);
-		return 0;
+		return sys_cputs((char *)a1, a2);
 	case SYS_cgetc:
 		return sys_cgetc();
 	case SYS_getenvid:
@@ -581,8 +1212,18 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		return sys_env_destroy(a1);
 	case SYS_yield:
 		sys_yield();
+	case SYS_yield_to:
+		sys_yield_to(a1);
 	case SYS_exofork:
 		return sys_exofork();
+	case SYS_fork:
+		return sys_fork();
+	case SYS_region_reserve:
+		return sys_region_reserve(a1, (void *) a2, a3, a4);
+	case SYS_env_set_faultaround:
+		return sys_env_set_faultaround(a1, a2);
+	case SYS_exec:
+		return sys_exec(a1, (const void *) a2, a3);
 	case SYS_env_set_status:
 		return sys_env_set_status(a1, a2);
 	case SYS_page_alloc:
@@ -595,10 +1236,32 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		return sys_env_set_pgfault_upcall(a1, (void *)a2);
 	case SYS_ipc_recv:
 		return sys_ipc_recv((void *)a1);
+	case SYS_ipc_recv_from:
+		return sys_ipc_recv_from(a1, (void *)a2);
 	case SYS_ipc_try_send:
 		return sys_ipc_try_send(a1, a2, (void *)a3, a4);
 	case SYS_env_set_trapframe:
 		return sys_env_set_trapframe(a1, (void *)a2);
+	case SYS_cgetc_wait:
+		return sys_cgetc_wait();
+	case SYS_env_wait:
+		return sys_env_wait(a1);
+	case SYS_futex_wait:
+		return sys_futex_wait((const uint32_t *)a1, a2, a3);
+	case SYS_futex_wake:
+		return sys_futex_wake((const uint32_t *)a1, a2);
+	case SYS_env_set_affinity:
+		return sys_env_set_affinity(a1, a2);
+	case SYS_sleep:
+		return sys_sleep(a1);
+	case SYS_time:
+		return sys_time();
+	case SYS_batch:
+		return sys_batch((struct Syscall *)a1, a2, a3);
+	case SYS_ring_setup:
+		return ring_setup(curenv, (void *)a1);
+	case SYS_ring_enter:
+		return ring_enter(curenv, a1);
 	default:
 		return -E_INVAL;
 	}
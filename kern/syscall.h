@@ -6,6 +6,11 @@
 
 #include <inc/syscall.h>
 
+struct Env;
+
 int32_t syscall(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5);
+void ipc_env_free(struct Env *e);
+int ipc_send_nowait(struct Env *src, envid_t envid, uint32_t value,
+		    void *srcva, unsigned perm);
 
 #endif /* !JOS_KERN_SYSCALL_H */
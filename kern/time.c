@@ -0,0 +1,257 @@
+// Timekeeping and per-CPU timer wheels.
+//
+// Time is read from the TSC, whose frequency is measured against the
+// PIT at boot.  Each CPU keeps a hierarchical timer wheel (as in
+// Varghese & Lauck, and Linux): TIMER_LEVELS levels of TIMER_SLOTS
+// slots, where a slot on level n spans TIMER_SLOTS^n jiffies.  A timer
+// is filed on the lowest level whose range covers it and is moved down
+// a level ("cascaded") when the wheel below wraps around, so arming,
+// cancelling and expiring a timer are all O(1).
+//
+// Each wheel has its own lock, so CPUs advance their wheels without
+// contending, and a timer that fires is taken off the wheel before
+// its callback runs under the timer's own lock (see timer_run()).
+
+#include <inc/x86.h>
+#include <inc/assert.h>
+#include <inc/stdio.h>
+#include <kern/time.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/pmap.h>
+
+#define TIMER_BITS	6
+#define TIMER_SLOTS	(1 << TIMER_BITS)
+#define TIMER_LEVELS	4
+#define TIMER_MAXDELTA	((1ULL << (TIMER_BITS * TIMER_LEVELS)) - 1)
+
+// PIT channel 2, used to calibrate the TSC.
+#define PIT_HZ		1193182
+#define PIT_CH2		0x42
+#define PIT_MODE	0x43
+#define PIT_GATE	0x61	// bit 0: ch2 gate, bit 1: speaker, bit 5: ch2 out
+#define CALIBRATE_MS	10
+
+uint64_t tsc_freq;
+uint64_t tsc_boot;
+
+struct timer_wheel {
+	struct spinlock tw_lock;	// Protects the rest
+	uint64_t tw_now;		// Last jiffy processed
+	int tw_count;			// Timers on the wheel, or expired
+	struct timer *tw_expired;	// Expired, waiting to be fired
+	struct timer *tw_slots[TIMER_LEVELS][TIMER_SLOTS];
+} __attribute__((aligned(CACHELINE)));
+
+static struct timer_wheel wheels[NCPU];
+
+// Measure the TSC frequency by timing CALIBRATE_MS on PIT channel 2.
+void
+time_init(void)
+{
+	uint32_t latch = PIT_HZ / (1000 / CALIBRATE_MS);
+	uint64_t t0, t1;
+	int i;
+
+	for (i = 0; i < NCPU; i++)
+		__spin_initlock(&wheels[i].tw_lock, "timer_wheel",
+				LOCK_RANK_TIMER, SPINLOCK_TAS);
+
+	// Gate channel 2 on with the speaker off, and count down once.
+	outb(PIT_GATE, (inb(PIT_GATE) & ~0x02) | 0x01);
+	outb(PIT_MODE, 0xb0);	// channel 2, lobyte/hibyte, mode 0
+	outb(PIT_CH2, latch & 0xff);
+	outb(PIT_CH2, latch >> 8);
+	t0 = read_tsc();
+	while (!(inb(PIT_GATE) & 0x20))
+		;
+	t1 = read_tsc();
+
+	tsc_freq = (t1 - t0) * (1000 / CALIBRATE_MS);
+	tsc_boot = t1;
+	cprintf("TSC: %llu MHz\n", tsc_freq / 1000000);
+
+	// Publish the clock so that user code can read it directly
+	ustats->us_tsc_freq = tsc_freq;
+	ustats->us_tsc_boot = tsc_boot;
+	ustats->us_ncpu = ncpu;
+}
+
+// Microseconds since time_init().
+uint64_t
+time_usec(void)
+{
+	uint64_t cycles = read_tsc() - tsc_boot;
+
+	// Split the conversion so cycles * 1000000 cannot overflow.
+	return cycles / tsc_freq * 1000000 +
+		cycles % tsc_freq * 1000000 / tsc_freq;
+}
+
+// Set up t to call func(arg) with 'lk', the lock protecting t, held.
+void
+timer_init(struct timer *t, void (*func)(void *), void *arg,
+	   struct spinlock *lk)
+{
+	t->t_next = NULL;
+	t->t_pprev = NULL;
+	t->t_wheel = NULL;
+	t->t_lock = lk;
+	t->t_func = func;
+	t->t_arg = arg;
+}
+
+// Put t on the list *list.
+static void
+timer_link(struct timer_wheel *w, struct timer *t, struct timer **list)
+{
+	t->t_next = *list;
+	if (t->t_next)
+		t->t_next->t_pprev = &t->t_next;
+	t->t_pprev = list;
+	*list = t;
+	w->tw_count++;
+}
+
+// Take the armed timer t off its wheel, whose lock must be held.
+static void
+timer_unlink(struct timer *t)
+{
+	t->t_wheel->tw_count--;
+	*t->t_pprev = t->t_next;
+	if (t->t_next)
+		t->t_next->t_pprev = t->t_pprev;
+	t->t_next = NULL;
+	t->t_pprev = NULL;
+}
+
+// File t in the slot of w that covers t->t_expires, which must not
+// be before w->tw_now.
+static void
+timer_enqueue(struct timer_wheel *w, struct timer *t)
+{
+	uint64_t expires = t->t_expires, delta;
+	struct timer **slot;
+	int level;
+
+	delta = expires - w->tw_now;
+	if (delta > TIMER_MAXDELTA)
+		// Park it in the farthest slot; it is re-filed when
+		// that slot comes around.
+		expires = w->tw_now + TIMER_MAXDELTA;
+
+	for (level = 0; level < TIMER_LEVELS - 1; level++)
+		if (delta < (1ULL << (TIMER_BITS * (level + 1))))
+			break;
+	slot = &w->tw_slots[level][(expires >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1)];
+	timer_link(w, t, slot);
+}
+
+// Arm t to fire 'usec' microseconds from now on this CPU's wheel.
+// Called with t's lock held.
+void
+timer_add(struct timer *t, uint64_t usec)
+{
+	struct timer_wheel *w = &wheels[cpunum()];
+
+	timer_del(t);
+	spin_lock(&w->tw_lock);
+	t->t_wheel = w;
+	t->t_expires = (time_usec() + usec + TIMER_JIFFY_USEC - 1) / TIMER_JIFFY_USEC;
+	// Jiffy tw_now has already been processed
+	if (t->t_expires <= w->tw_now)
+		t->t_expires = w->tw_now + 1;
+	timer_enqueue(w, t);
+	spin_unlock(&w->tw_lock);
+}
+
+// Disarm t if it is pending.  Called with t's lock held.
+void
+timer_del(struct timer *t)
+{
+	struct timer_wheel *w = t->t_wheel;
+
+	// t_wheel only changes under t's lock
+	if (!w)
+		return;
+	spin_lock(&w->tw_lock);
+	if (timer_pending(t))
+		timer_unlink(t);
+	spin_unlock(&w->tw_lock);
+}
+
+// Move the timers in *slot to the list *list, so that they can be
+// taken off one by one with timer_unlink().
+static void
+slot_take(struct timer **slot, struct timer **list)
+{
+	*list = *slot;
+	*slot = NULL;
+	if (*list)
+		(*list)->t_pprev = list;
+}
+
+// Advance this CPU's wheel to the current time, firing every timer
+// that has expired.  Called from the timer interrupt with no locks
+// held.
+void
+timer_run(void)
+{
+	struct timer_wheel *w = &wheels[cpunum()];
+	uint64_t now = time_usec() / TIMER_JIFFY_USEC;
+	struct timer *t, *list;
+	struct spinlock *lk;
+	int level, idx;
+	bool fire;
+
+	spin_lock(&w->tw_lock);
+	// Nothing to fire: just catch up.
+	if (w->tw_count == 0 && w->tw_now < now)
+		w->tw_now = now;
+
+	while (w->tw_now < now) {
+		w->tw_now++;
+
+		// Each time a level wraps, move the next slot of the
+		// level above down into the levels below.
+		for (level = 1; level < TIMER_LEVELS; level++) {
+			if (w->tw_now & ((1ULL << (TIMER_BITS * level)) - 1))
+				break;
+			idx = (w->tw_now >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1);
+			slot_take(&w->tw_slots[level][idx], &list);
+			while ((t = list) != NULL) {
+				timer_unlink(t);
+				timer_enqueue(w, t);
+			}
+		}
+
+		slot_take(&w->tw_slots[0][w->tw_now & (TIMER_SLOTS - 1)], &list);
+		while ((t = list) != NULL) {
+			timer_unlink(t);
+			if (t->t_expires > w->tw_now)
+				timer_enqueue(w, t);
+			else
+				timer_link(w, t, &w->tw_expired);
+		}
+	}
+
+	// Fire the expired timers.  A timer's lock comes before the
+	// wheel's in the lock order, so drop the wheel's to take it, and
+	// then check that t was not cancelled, or armed again, meanwhile.
+	while ((t = w->tw_expired) != NULL) {
+		lk = t->t_lock;
+		spin_unlock(&w->tw_lock);
+		spin_lock(lk);
+		spin_lock(&w->tw_lock);
+		fire = t->t_wheel == w && timer_pending(t) &&
+			t->t_expires <= w->tw_now;
+		if (fire)
+			timer_unlink(t);
+		spin_unlock(&w->tw_lock);
+		if (fire)
+			t->t_func(t->t_arg);
+		spin_unlock(lk);
+		spin_lock(&w->tw_lock);
+	}
+	spin_unlock(&w->tw_lock);
+}
@@ -0,0 +1,48 @@
+#ifndef JOS_KERN_TIME_H
+#define JOS_KERN_TIME_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct spinlock;
+struct timer_wheel;
+
+// Resolution of the timer wheels, in microseconds.
+#define TIMER_JIFFY_USEC	1000
+
+// A one-shot timer.  Each timer is protected by the lock it was
+// initialized with, which callers of timer_add() and timer_del() must
+// hold, and 'func' is called with it held, on the CPU that armed the
+// timer.  The wheels themselves have locks of their own.
+struct timer {
+	struct timer *t_next;		// Next timer in the same wheel slot
+	struct timer **t_pprev;		// Link pointing to us, or NULL if idle
+	uint64_t t_expires;		// Jiffy at which the timer fires
+	struct timer_wheel *t_wheel;	// Wheel the timer is armed on
+	struct spinlock *t_lock;	// Lock protecting the timer
+	void (*t_func)(void *arg);
+	void *t_arg;
+};
+
+extern uint64_t tsc_freq;		// TSC cycles per second
+extern uint64_t tsc_boot;		// TSC at time_init()
+
+void time_init(void);
+uint64_t time_usec(void);
+
+void timer_init(struct timer *t, void (*func)(void *), void *arg,
+		struct spinlock *lk);
+void timer_add(struct timer *t, uint64_t usec);
+void timer_del(struct timer *t);
+void timer_run(void);
+
+// Is t armed?  Only stable with t's lock held.
+static inline bool
+timer_pending(struct timer *t)
+{
+	return t->t_pprev != NULL;
+}
+
+#endif	// !JOS_KERN_TIME_H
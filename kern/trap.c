@@ -13,6 +13,14 @@
 #include <kern/picirq.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/fpu.h>
+#include <kern/ring.h>
+#include <kern/region.h>
+
+#define CPUID_SEP		(1 << 11)	// CPUID.1:EDX, SYSENTER and SYSEXIT
+#define MSR_SYSENTER_CS		0x174
+#define MSR_SYSENTER_ESP	0x175
+#define MSR_SYSENTER_EIP	0x176
 
 static struct Taskstate ts;
 
@@ -62,9 +70,12 @@ static const char *trapname(int trapno)
 		return "System call";
 	if (trapno >= IRQ_OFFSET && trapno < IRQ_OFFSET + 16)
 		return "Hardware Interrupt";
+	if (trapno == IRQ_OFFSET + IRQ_RESCHED)
+		return "Reschedule IPI";
 	return "(unknown trap)";
 }
 
+extern void sysenter_entry();
 extern void ENTRY_DIVIDE();
 extern void ENTRY_DEBUG();
 extern void ENTRY_NMI();
@@ -104,6 +115,8 @@ extern void ENTRY_IRQ13();
 extern void ENTRY_IRQ14();
 extern void ENTRY_IRQ15();
 
+extern void ENTRY_RESCHED();
+
 void
 trap_init(void)
 {
@@ -153,10 +166,33 @@ trap_init(void)
 	SETGATE(idt[IRQ_OFFSET + 14], 0, GD_KT, &ENTRY_IRQ14, 0);
 	SETGATE(idt[IRQ_OFFSET + 15], 0, GD_KT, &ENTRY_IRQ15, 0);
 
+	SETGATE(idt[IRQ_OFFSET + IRQ_RESCHED], 0, GD_KT, &ENTRY_RESCHED, 0);
+
+	// Cleared by trap_init_percpu() on any CPU without SYSENTER
+	ustats->us_sysenter = 1;
+
 	// Per-CPU setup 
 	trap_init_percpu();
 }
 
+// Point %gs at CPU i's per-CPU data segment, which is based at cpus[i]
+// and is where thiscpu is read from.  Each CPU calls this before its
+// first use of thiscpu; the boot CPU assumes it is CPU 0 until the
+// LAPIC is mapped, and trap_init_percpu() calls this again with the
+// real index.  _alltraps reloads %gs on every trap.
+void
+percpu_init(int i)
+{
+	extern struct Pseudodesc gdt_pd;
+
+	static_assert(GD_KCPU0 == GD_TSS0 + (NCPU << 3));
+	cpus[i].cpu_self = &cpus[i];
+	gdt[(GD_KCPU0 >> 3) + i] = SEG16(STA_W, (uint32_t) &cpus[i],
+					 sizeof(struct CpuInfo) - 1, 0);
+	lgdt(&gdt_pd);
+	asm volatile("movw %%ax,%%gs" : : "a" (GD_KCPU0 + (i << 3)));
+}
+
 // Initialize and load the per-CPU TSS and IDT
 void
 trap_init_percpu(void)
@@ -185,7 +221,10 @@ trap_init_percpu(void)
 	// user space on that CPU.
 	//
 	// LAB 4: Your code here:
-	int i = cpunum();
+	int i = lapic_id();
+	uint32_t edx;
+
+	percpu_init(i);
 	intptr_t kstacktop_i = KSTACKTOP - i * (KSTKSIZE + KSTKGAP);
 	thiscpu->cpu_ts.ts_esp0 = kstacktop_i;
 	thiscpu->cpu_ts.ts_ss0 = GD_KD;
@@ -198,7 +237,17 @@ trap_init_percpu(void)
 	ltr(GD_TSS0 + (i << 3));
 
 	lidt(&idt_pd);
-	
+
+	// Fast system calls enter on this CPU's kernel stack
+	cpuid(1, NULL, NULL, NULL, &edx);
+	if (edx & CPUID_SEP) {
+		wrmsr(MSR_SYSENTER_CS, GD_KT);
+		wrmsr(MSR_SYSENTER_ESP, kstacktop_i);
+		wrmsr(MSR_SYSENTER_EIP, (uint32_t) sysenter_entry);
+	} else
+		ustats->us_sysenter = 0;
+
+	fpu_init();
 	return;
 
 	// Setup a TSS so that we get the right stack
@@ -225,6 +274,7 @@ print_trapframe(struct Trapframe *tf)
 {
 	cprintf("TRAP frame at %p from CPU %d\n", tf, cpunum());
 	print_regs(&tf->tf_regs);
+	cprintf("  gs   0x----%04x\n", tf->tf_gs);
 	cprintf("  es   0x----%04x\n", tf->tf_es);
 	cprintf("  ds   0x----%04x\n", tf->tf_ds);
 	cprintf("  trap 0x%08x %s\n", tf->tf_trapno, trapname(tf->tf_trapno));
@@ -277,6 +327,13 @@ trap_dispatch(struct Trapframe *tf)
 		return;
 	}
 
+	// First FPU or SSE instruction since the env was switched in
+	if (tf->tf_trapno == T_DEVICE && (tf->tf_cs & 3) == 3)
+	{
+		fpu_trap();
+		return;
+	}
+
 	if (tf->tf_trapno == T_BRKPT || tf->tf_trapno == T_DEBUG)
 	{
 		monitor(tf);
@@ -305,6 +362,14 @@ trap_dispatch(struct Trapframe *tf)
 	// interrupt using lapic_eoi() before calling the scheduler!
 	// LAB 4: Your code here.
 	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER)
+	{
+		lapic_eoi();
+		sched_tick();
+		sched_yield();
+	}
+
+	// Another CPU queued work for us while we were halted.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_RESCHED)
 	{
 		lapic_eoi();
 		sched_yield();
@@ -333,6 +398,68 @@ trap_dispatch(struct Trapframe *tf)
 	}
 }
 
+// Have curenv, which is to resume from tf, run its page fault upcall
+// for a fault at 'fault_va' with error code 'err' first.  Returns
+// false if it has no upcall.
+static bool
+page_fault_upcall(struct Trapframe *tf, uint32_t fault_va, uint32_t err)
+{
+	struct UTrapframe *utf;
+
+	if (!curenv->env_pgfault_upcall)
+		return false;
+
+	if (tf->tf_esp >= UXSTACKTOP - PGSIZE && tf->tf_esp < UXSTACKTOP)
+	{
+		// already running on the user exception stack
+		utf = (struct UTrapframe*)(tf->tf_esp - 4 - sizeof(struct UTrapframe));
+	}
+	else 
+	{
+		// running on normal user stack
+		utf = (struct UTrapframe*)(UXSTACKTOP - sizeof(struct UTrapframe));
+	}
+
+	// validity check of exception stack
+	user_mem_assert(curenv, utf, sizeof(struct UTrapframe), PTE_W);
+
+	// fill in utf
+	utf->utf_fault_va = fault_va;
+	utf->utf_err = err;
+	utf->utf_regs = tf->tf_regs;
+	utf->utf_eip = tf->tf_eip;
+	utf->utf_eflags = tf->tf_eflags;
+	utf->utf_esp = tf->tf_esp;
+
+	// run the user page fault handler with new stack;
+	// curenv is resumed from tf
+	tf->tf_eip = (intptr_t)curenv->env_pgfault_upcall;
+	tf->tf_esp = (uintptr_t)utf;
+	return true;
+}
+
+// A system call that curenv made has failed with -E_PAGEIN, for the
+// page at curenv->env_pagein_va that its pager has yet to page in (see
+// user_arg_check()).  Have curenv take the page fault that a read of
+// the page would, as it returns from the call: its pager pages the page
+// in, and the system call stub makes the call again.
+static void
+pagein_upcall(struct Trapframe *tf)
+{
+	uintptr_t va = curenv->env_pagein_va;
+	pte_t *pte;
+	bool mapped;
+
+	curenv->env_pagein_va = 0;
+	// Another env may have mapped the page meanwhile
+	lock_env(curenv);
+	pte = pgdir_walk(curenv->env_pgdir, (void *) va, 0);
+	mapped = pte && (*pte & PTE_P);
+	unlock_env(curenv);
+	if (!mapped)
+		page_fault_upcall(tf, va, FEC_U);
+}
+
 void
 trap(struct Trapframe *tf)
 {
@@ -345,10 +472,11 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
-	// Re-acqurie the big kernel lock if we were halted in
-	// sched_yield()
+	// Note that we are no longer halted in sched_halt(), and count
+	// the time spent there as idle
 	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
-		lock_kernel();
+		ustats->us_cpus[cpunum()].usc_idle +=
+			read_tsc() - thiscpu->cpu_halt_tsc;
 	// Check that interrupts are disabled.  If this assertion
 	// fails, DO NOT be tempted to fix it by inserting a "cli" in
 	// the interrupt path.
@@ -356,16 +484,14 @@ trap(struct Trapframe *tf)
 
 	if ((tf->tf_cs & 3) == 3) {
 		// Trapped from user mode.
-		// Acquire the big kernel lock before doing any
-		// serious kernel work.
-		// LAB 4: Your code here.
+		// There is no big kernel lock: each subsystem takes its
+		// own locks (see kern/spinlock.h), so traps on different
+		// CPUs proceed in parallel.
 		assert(curenv);
-		lock_kernel();
 
 		// Garbage collect if current enviroment is a zombie
 		if (curenv->env_status == ENV_DYING) {
-			env_free(curenv);
-			curenv = NULL;
+			env_reap_later(curenv);
 			sched_yield();
 		}
 
@@ -375,6 +501,9 @@ trap(struct Trapframe *tf)
 		curenv->env_tf = *tf;
 		// The trapframe on the stack should be ignored from here on.
 		tf = &curenv->env_tf;
+
+		// Take whatever curenv has queued on its system call ring
+		ring_poll(curenv);
 	}
 
 	// Record that tf is the last real trapframe so
@@ -384,20 +513,81 @@ trap(struct Trapframe *tf)
 	// Dispatch based on what type of trap occurred
 	trap_dispatch(tf);
 
+	if ((tf->tf_cs & 3) == 3 && curenv->env_pagein_va)
+		pagein_upcall(tf);
+
 	// If we made it to this point, then no other environment was
 	// scheduled, so we should return to the current environment
 	// if doing so makes sense.
+	spin_lock(&env_table_lock);
 	if (curenv && curenv->env_status == ENV_RUNNING)
 		env_run(curenv);
-	else
-		sched_yield();
+	spin_unlock(&env_table_lock);
+	sched_yield();
 }
 
+// System calls made through sysenter_entry.  Only the registers that
+// the stub in lib/syscall.c needs preserved are saved to
+// curenv->env_tf, but that is enough for curenv to be resumed from it
+// if the system call blocks.  Returns the result to sysenter_entry.
+int32_t
+sysenter_syscall(struct SysenterFrame *sf)
+{
+	struct Trapframe *tf;
+	int32_t r;
+
+	extern char *panicstr;
+	if (panicstr)
+		asm volatile("hlt");
+
+	if (curenv->env_status == ENV_DYING) {
+		env_reap_later(curenv);
+		sched_yield();
+	}
+
+	tf = &curenv->env_tf;
+	tf->tf_regs.reg_eax = sf->sf_eax;
+	tf->tf_regs.reg_ebx = sf->sf_ebx;
+	tf->tf_regs.reg_edi = sf->sf_edi;
+	tf->tf_regs.reg_esi = sf->sf_esi;
+	tf->tf_regs.reg_ebp = sf->sf_ebp;
+	tf->tf_ds = sf->sf_ds;
+	tf->tf_es = sf->sf_es;
+	tf->tf_gs = sf->sf_gs;
+	tf->tf_trapno = T_SYSCALL;
+	tf->tf_eip = sf->sf_esi;
+	tf->tf_esp = sf->sf_ebp;
+	// The flags are not saved, and tf_eflags may hold any left from
+	// the last trap (DF, say), so resume with the ones a caller of
+	// the stub has: only IF, and IOPL, set.
+	tf->tf_eflags = FL_IF | (tf->tf_eflags & FL_IOPL_MASK);
+	last_tf = tf;
+
+	ring_poll(curenv);
+	r = syscall(sf->sf_eax, sf->sf_edx, sf->sf_ecx, sf->sf_ebx,
+		    sf->sf_edi, 0);
+	tf->tf_regs.reg_eax = r;
+	if (curenv->env_pagein_va)
+		pagein_upcall(tf);
+
+	// Like trap(), give up the CPU if curenv was stopped meanwhile,
+	// and return through its trap frame if the system call moved it
+	// elsewhere (sys_env_set_trapframe on itself, say).
+	if (curenv->env_status != ENV_RUNNING)
+		sched_yield();
+	if (tf->tf_eip != sf->sf_esi || tf->tf_esp != sf->sf_ebp) {
+		spin_lock(&env_table_lock);
+		env_run(curenv);
+	}
+	return r;
+}
 
 void
 page_fault_handler(struct Trapframe *tf)
 {
 	uint32_t fault_va;
+	bool cow;
+	int r;
 
 	// Read processor's CR2 register to find the faulting address
 	fault_va = rcr2();
@@ -414,6 +604,24 @@ page_fault_handler(struct Trapframe *tf)
 	// We've already handled kernel-mode exceptions, so if we get here,
 	// the page fault happened in user mode.
 
+	// Copy-on-write and demand-zero pages are mapped right here, with
+	// no upcall, along with their neighbors
+	cow = (tf->tf_err & (FEC_PR | FEC_WR)) == (FEC_PR | FEC_WR);
+	if (cow || !(tf->tf_err & FEC_PR)) {
+		lock_env(curenv);
+		if (cow)
+			r = page_cow_break(curenv->env_pgdir, (void *) fault_va);
+		else
+			r = region_fault(curenv, fault_va);
+		if (r == 0) {
+			curenv->env_pgfaults++;
+			region_fault_around(curenv, fault_va, cow);
+		}
+		unlock_env(curenv);
+		if (r == 0)
+			return;
+	}
+
 	// Call the environment's page fault upcall, if one exists.  Set up a
 	// page fault stack frame on the user exception stack (below
 	// UXSTACKTOP), then branch to curenv->env_pgfault_upcall.
@@ -445,37 +653,8 @@ page_fault_handler(struct Trapframe *tf)
 
 	// LAB 4: Your code here.
 
-	if (curenv->env_pgfault_upcall)
-	{
-		struct UTrapframe *utf;
-
-		if (tf->tf_esp >= UXSTACKTOP - PGSIZE && tf->tf_esp < UXSTACKTOP)
-		{
-			// already running on the user exception stack
-			utf = (struct UTrapframe*)(tf->tf_esp - 4 - sizeof(struct UTrapframe));
-		}
-		else 
-		{
-			// running on normal user stack
-			utf = (struct UTrapframe*)(UXSTACKTOP - sizeof(struct UTrapframe));
-		}
-
-		// validity check of exception stack
-		user_mem_assert(curenv, utf, sizeof(struct UTrapframe), PTE_W);
-
-		// fill in utf
-		utf->utf_fault_va = fault_va;
-		utf->utf_err = tf->tf_err;
-		utf->utf_regs = tf->tf_regs;
-		utf->utf_eip = tf->tf_eip;
-		utf->utf_eflags = tf->tf_eflags;
-		utf->utf_esp = tf->tf_esp;
-
-		// run the user page fault handler with new stack
-		tf->tf_eip = (intptr_t)curenv->env_pgfault_upcall;
-		tf->tf_esp = (uintptr_t)utf;
-		env_run(curenv);
-	}
+	if (page_fault_upcall(tf, fault_va, tf->tf_err))
+		return;
 
 	// Destroy the environment that caused the fault.
 	cprintf("[%08x] user fault va %08x ip %08x\n",
@@ -9,12 +9,30 @@
 #include <inc/trap.h>
 #include <inc/mmu.h>
 
+// What sysenter_entry saves of the user's registers.
+struct SysenterFrame {
+	uint32_t sf_eax;	// System call number
+	uint32_t sf_edx;	// Arguments 1-4
+	uint32_t sf_ecx;
+	uint32_t sf_ebx;
+	uint32_t sf_edi;
+	uint32_t sf_esi;	// %eip to return to
+	uint32_t sf_ebp;	// %esp to return to
+	uint16_t sf_ds;
+	uint16_t sf_padding1;
+	uint16_t sf_es;
+	uint16_t sf_padding2;
+	uint16_t sf_gs;
+	uint16_t sf_padding3;
+} __attribute__((packed));
+
 /* The kernel's interrupt descriptor table */
 extern struct Gatedesc idt[];
 extern struct Pseudodesc idt_pd;
 
 void trap_init(void);
 void trap_init_percpu(void);
+int32_t sysenter_syscall(struct SysenterFrame *sf);
 void print_regs(struct PushRegs *regs);
 void print_trapframe(struct Trapframe *tf);
 void page_fault_handler(struct Trapframe *);
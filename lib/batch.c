@@ -0,0 +1,41 @@
+// Building up system calls to make together with sys_batch().
+
+#include <inc/lib.h>
+
+// Queue a system call on b, making the queued ones first if b is full.
+// Returns 0, or the first error of the calls made.
+int
+batch_add(struct SyscallBatch *b, int num, uint32_t a1, uint32_t a2,
+	  uint32_t a3, uint32_t a4, uint32_t a5)
+{
+	struct Syscall *sc;
+
+	if (b->sb_n == b->sb_max) {
+		int r = batch_flush(b);
+		if (r < 0)
+			return r;
+	}
+	sc = &b->sb_calls[b->sb_n++];
+	sc->sc_num = num;
+	sc->sc_args[0] = a1;
+	sc->sc_args[1] = a2;
+	sc->sc_args[2] = a3;
+	sc->sc_args[3] = a4;
+	sc->sc_args[4] = a5;
+	return 0;
+}
+
+// Make the system calls queued on b, stopping at the first that fails.
+// Returns 0, or that call's error.
+int
+batch_flush(struct SyscallBatch *b)
+{
+	int n = b->sb_n, r;
+
+	b->sb_n = 0;
+	if (n == 0)
+		return 0;
+	if ((r = sys_batch(b->sb_calls, n, BATCH_STOPONERR)) <= 0)
+		return r;
+	return MIN(b->sb_calls[r - 1].sc_ret, 0);
+}
@@ -139,6 +139,7 @@ devfile_read_map(struct Fd *fd, void *addr, off_t offset, int perm)
 	fsipcbuf.read_map.req_fileid = fd->fd_file.id;
 	fsipcbuf.read_map.req_offset = offset;
 	fsipcbuf.read_map.req_perm = perm;
+	fsipcbuf.read_map.req_version = fd->fd_file.version;
 	if ((r = fsipc(FSREQ_READ_MAP, addr)) < 0)
 		return r;
 
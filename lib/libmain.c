@@ -1,15 +1,13 @@
 // Called from entry.S to get us going.
-// entry.S already took care of defining envs, pages, uvpd, and uvpt.
+// globals.S already took care of defining envs, pages, ustats, uvpd, and uvpt.
 
 #include <inc/lib.h>
 
-extern void umain(int argc, char **argv);
-
 const volatile struct Env *thisenv;
 const char *binaryname = "<unknown>";
 
 void
-libmain(int argc, char **argv)
+libmain(void (*umain)(int argc, char **argv), int argc, char **argv)
 {
 	// set thisenv to point at our Env structure in envs[].
 	// LAB 3: Your code here.
@@ -0,0 +1,149 @@
+// Demand paging of a program that spawn() loads lazily.
+//
+// spawn() maps nothing of the program file into the child but its ELF
+// headers: the child starts with libjos, which the kernel maps into
+// every env (kern/shlib.c), its stack, and a struct PagerInfo at
+// UPAGERINFO describing the program file, and with _pager_upcall
+// (lib/pfentry.S) as its page fault upcall.  The first touch of a page
+// of the program's segments then asks the file server to read_map()
+// the page's file block there: read-only pages with nothing but file
+// data share the block cache page, writable ones map it copy-on-write,
+// so that the kernel copies it on the first write, and the pages that
+// also hold BSS get a copy of their file data.  Other faults go to the
+// handler set by set_pgfault_handler(), if any.
+//
+// Nothing the pager runs may itself be paged in: since the file server
+// waits for a client to receive each reply, a client that faulted
+// between a request and its reply would leave the pager waiting on the
+// file server and the file server on the client.  The pager only runs
+// libjos, which is never paged in.
+//
+// A system call given part of the program that has not been paged in
+// yet fails with -E_PAGEIN, after the kernel has run the pager for it
+// as if we had touched it, and the system call stubs (lib/syscall.c)
+// make the call again.  Ring submissions are made on kernel entries
+// that may be the pager's own, so ring_submit() pages in what it
+// passes with pager_prefault() instead.
+
+#include <inc/lib.h>
+
+// Pointer to the C page fault handler, if one is set (lib/pgfault.c).
+extern void (*_pgfault_handler)(struct UTrapframe *utf);
+
+// Map the block of the program file at 'offset' at dstva with 'perm'.
+static int
+pager_read_map(struct PagerInfo *pi, off_t offset, void *dstva, int perm)
+{
+	union Fsipc *req = (union Fsipc *) UPAGERREQ;
+	int r;
+
+	req->read_map.req_fileid = pi->pi_fileid;
+	req->read_map.req_offset = offset;
+	req->read_map.req_perm = perm;
+	req->read_map.req_version = pi->pi_version;
+	if ((r = sys_ipc_try_send(pi->pi_fsenv, FSREQ_READ_MAP, req,
+				  PTE_P | PTE_W | PTE_U)) < 0)
+		return r;
+	// Leave messages from anyone else for the program to receive
+	if ((r = sys_ipc_recv_from(pi->pi_fsenv, dstva)) < 0)
+		return r;
+	return envs[ENVX(sys_getenvid())].env_ipc_value;
+}
+
+// Page in the page at va of segment ps.
+static int
+pager_load(struct PagerInfo *pi, struct PagerSeg *ps, uintptr_t va)
+{
+	off_t offset;
+	uintptr_t lo, hi;
+	int r;
+
+	offset = ROUNDDOWN(ps->ps_offset, PGSIZE) +
+		(va - ROUNDDOWN(ps->ps_va, PGSIZE));
+	if (MIN(va + PGSIZE, ps->ps_end) <= ps->ps_fend)
+		return pager_read_map(pi, offset, (void *) va,
+				      (ps->ps_perm & PTE_W) ?
+				      PTE_P | PTE_U | PTE_COW : PTE_P | PTE_U);
+
+	// Part of the page reads as zero, so it needs a copy
+	if ((r = pager_read_map(pi, offset, UPAGERTEMP, PTE_P | PTE_U)) < 0)
+		return r;
+	if ((r = sys_page_alloc(0, (void *) va, PTE_P | PTE_U | PTE_W)) < 0)
+		goto out;
+	lo = MAX(va, ps->ps_va);
+	hi = MIN(va + PGSIZE, ps->ps_fend);
+	memmove((void *) lo, UPAGERTEMP + (lo - va), hi - lo);
+	if (!(ps->ps_perm & PTE_W))
+		r = sys_page_map(0, (void *) va, 0, (void *) va, ps->ps_perm);
+out:
+	sys_page_unmap(0, UPAGERTEMP);
+	return r;
+}
+
+// End of the pages of ps that are paged in from the program file:
+// those past it are BSS, which the kernel leaves demand-zero.
+static uintptr_t
+pager_seg_end(struct PagerSeg *ps)
+{
+	return MIN(ROUNDUP(ps->ps_fend, PGSIZE), ps->ps_end);
+}
+
+// The page fault handler of a lazily loaded program, called by
+// _pager_upcall.
+void
+pager_handler(struct UTrapframe *utf)
+{
+	struct PagerInfo *pi = (struct PagerInfo *) UPAGERINFO;
+	struct PagerSeg *ps;
+	uintptr_t va = ROUNDDOWN(utf->utf_fault_va, PGSIZE);
+	int r;
+
+	if (!(utf->utf_err & FEC_PR))
+		for (ps = pi->pi_seg; ps < pi->pi_seg + pi->pi_nseg; ps++)
+			if (va >= ROUNDDOWN(ps->ps_va, PGSIZE) &&
+			    va < pager_seg_end(ps)) {
+				if ((r = pager_load(pi, ps, va)) == 0)
+					return;
+				cprintf("pager: cannot page in %08x: %e\n", va, r);
+				break;
+			}
+
+	if (_pgfault_handler) {
+		_pgfault_handler(utf);
+		return;
+	}
+	// Nobody handles the fault: retry it without an upcall, so that
+	// the kernel reports it and destroys us as it would have
+	sys_env_set_pgfault_upcall(0, NULL);
+}
+
+// Page in the pages of [va, va+len) that a fault would, for a ring
+// submission about to pass them to the kernel.
+void
+pager_prefault(const void *va, size_t len)
+{
+	struct PagerInfo *pi = (struct PagerInfo *) UPAGERINFO;
+	struct PagerSeg *ps;
+	uintptr_t pva, end;
+
+	if (len == 0 || !pager_active())
+		return;
+	end = (uintptr_t) va + len;
+	if (end < (uintptr_t) va)
+		end = ~0U;
+	for (ps = pi->pi_seg; ps < pi->pi_seg + pi->pi_nseg; ps++)
+		for (pva = MAX(ROUNDDOWN((uintptr_t) va, PGSIZE),
+			       ROUNDDOWN(ps->ps_va, PGSIZE));
+		     pva < MIN(end, pager_seg_end(ps)); pva += PGSIZE)
+			if (!(uvpd[PDX(pva)] & PTE_P) ||
+			    !(uvpt[PGNUM(pva)] & PTE_P))
+				pager_load(pi, ps, pva);
+}
+
+// Is this program paged in by the pager?
+bool
+pager_active(void)
+{
+	return (uvpd[PDX(UPAGERINFO)] & PTE_P) &&
+		(uvpt[PGNUM(UPAGERINFO)] & PTE_P);
+}
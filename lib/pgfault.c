@@ -26,7 +26,9 @@ set_pgfault_handler(void (*handler)(struct UTrapframe *utf))
 {
 	int r;
 
-	if (_pgfault_handler == 0) {
+	// A lazily loaded program's pager calls the handler for the
+	// faults it does not handle itself, and has its exception stack
+	if (_pgfault_handler == 0 && !pager_active()) {
 		// First time through!
 		// LAB 4: Your code here.
 		sys_page_alloc(0, (void *)(UXSTACKTOP - PGSIZE), PTE_W | PTE_U | PTE_P);
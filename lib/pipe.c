@@ -1,4 +1,5 @@
 #include <inc/lib.h>
+#include <inc/x86.h>
 
 #define debug 0
 
@@ -19,9 +20,19 @@ struct Dev devpipe =
 
 #define PIPEBUFSIZ 32		// small to provoke races
 
+// A blocked reader or writer sleeps at most this many microseconds
+// before checking again whether the other end has been closed.  Closing
+// unmaps the pipe, which wakes it (see sys_page_unmap()), so this only
+// matters if the other end is destroyed without closing, or closes
+// between our check and our sleep.
+#define PIPE_WAIT_USEC	100000
+
 struct Pipe {
 	off_t p_rpos;		// read position
 	off_t p_wpos;		// write position
+	uint32_t p_rwaiting;	// a reader may be asleep on p_wpos
+	uint32_t p_wwaiting;	// a writer may be asleep on p_rpos
+	envid_t p_reader;	// last reader to go to sleep
 	uint8_t p_buf[PIPEBUFSIZ];	// data buffer
 };
 
@@ -101,11 +112,33 @@ pipeisclosed(int fdnum)
 	return _pipeisclosed(fd, p);
 }
 
+// Sleep until *pos may have moved on from 'seen'.  Setting the flag
+// with xchg before re-reading *pos pairs with the xchg in pipe_wake(),
+// so either the waker sees the flag or we see the new position.
+static void
+pipe_wait(uint32_t *waiting, volatile off_t *pos, off_t seen)
+{
+	xchg(waiting, 1);
+	if (*pos == seen)
+		sys_futex_wait(pos, seen, PIPE_WAIT_USEC);
+}
+
+// Wake the envs asleep on *pos, if there may be any.
+// Returns the number of envs woken.
+static int
+pipe_wake(uint32_t *waiting, volatile off_t *pos)
+{
+	if (xchg(waiting, 0))
+		return sys_futex_wake(pos, -1);
+	return 0;
+}
+
 static ssize_t
 devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 {
 	uint8_t *buf;
 	size_t i;
+	off_t wpos;
 	struct Pipe *p;
 
 	p = (struct Pipe*)fd2data(fd);
@@ -115,24 +148,28 @@ devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 
 	buf = vbuf;
 	for (i = 0; i < n; i++) {
-		while (p->p_rpos == p->p_wpos) {
+		while ((wpos = p->p_wpos) == p->p_rpos) {
 			// pipe is empty
 			// if we got any data, return it
-			if (i > 0)
+			if (i > 0) {
+				pipe_wake(&p->p_wwaiting, &p->p_rpos);
 				return i;
+			}
 			// if all the writers are gone, note eof
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// sleep until a writer adds something
 			if (debug)
-				cprintf("devpipe_read yield\n");
-			sys_yield();
+				cprintf("devpipe_read wait\n");
+			p->p_reader = thisenv->env_id;
+			pipe_wait(&p->p_rwaiting, &p->p_wpos, wpos);
 		}
 		// there's a byte.  take it.
 		// wait to increment rpos until the byte is taken!
 		buf[i] = p->p_buf[p->p_rpos % PIPEBUFSIZ];
 		p->p_rpos++;
 	}
+	pipe_wake(&p->p_wwaiting, &p->p_rpos);
 	return i;
 }
 
@@ -141,6 +178,7 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 {
 	const uint8_t *buf;
 	size_t i;
+	off_t rpos;
 	struct Pipe *p;
 
 	p = (struct Pipe*) fd2data(fd);
@@ -150,17 +188,21 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 
 	buf = vbuf;
 	for (i = 0; i < n; i++) {
-		while (p->p_wpos >= p->p_rpos + sizeof(p->p_buf)) {
+		while (p->p_wpos >= (rpos = p->p_rpos) + sizeof(p->p_buf)) {
 			// pipe is full
 			// if all the readers are gone
 			// (it's only writers like us now),
 			// note eof
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// let readers at what we wrote, handing our
+			// time slice to the one we woke, then sleep
+			// until one makes room
 			if (debug)
-				cprintf("devpipe_write yield\n");
-			sys_yield();
+				cprintf("devpipe_write wait\n");
+			if (pipe_wake(&p->p_rwaiting, &p->p_wpos) > 0)
+				sys_yield_to(p->p_reader);
+			pipe_wait(&p->p_wwaiting, &p->p_rpos, rpos);
 		}
 		// there's room for a byte.  store it.
 		// wait to increment wpos until the byte is stored!
@@ -168,6 +210,7 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 		p->p_wpos++;
 	}
 
+	pipe_wake(&p->p_rwaiting, &p->p_wpos);
 	return i;
 }
 
@@ -186,6 +229,8 @@ static int
 devpipe_close(struct Fd *fd)
 {
 	(void) sys_page_unmap(0, fd);
+	// Unmapping the pipe wakes whoever sleeps on the other end, once
+	// we are gone for it to see
 	return sys_page_unmap(0, fd2data(fd));
 }
 
@@ -0,0 +1,87 @@
+// System call rings (see inc/syscall.h).
+
+#include <inc/lib.h>
+
+// The ring page lives just below the file descriptor table (lib/fd.c).
+// It is PTE_SHARE so that a fork() does not make it copy-on-write
+// under the kernel; a child that wants a ring sets up its own.
+#define RINGVA		0xCFFFF000
+
+static volatile struct SyscallRing *const ring =
+	(volatile struct SyscallRing *) RINGVA;
+static envid_t ring_owner;
+
+// Set up a system call ring for this env, if it has none yet.
+// Returns 0 on success, < 0 on error.
+int
+ring_open(void)
+{
+	int r;
+
+	if (ring_owner == thisenv->env_id)
+		return 0;
+	if ((r = sys_page_alloc(0, (void *) RINGVA,
+				PTE_P | PTE_U | PTE_W | PTE_SHARE)) < 0)
+		return r;
+	if ((r = sys_ring_setup((void *) RINGVA)) < 0) {
+		sys_page_unmap(0, (void *) RINGVA);
+		return r;
+	}
+	ring_owner = thisenv->env_id;
+	return 0;
+}
+
+// Queue a system call on the ring.  It is made on our next kernel
+// entry, or by an idle CPU, and its result comes back through
+// ring_reap().  The kernel does not have our pager page in the memory
+// of a submission (see lib/pager.c), so the page a submission passes
+// is paged in here.  Returns 0, or -E_NO_MEM if the ring is full.
+int
+ring_submit(int num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
+	    uint32_t a5)
+{
+	volatile struct Syscall *sc;
+	uint32_t tail = ring->sr_sq_tail;
+
+	if (ring_owner != thisenv->env_id)
+		return -E_INVAL;
+	if (tail - ring->sr_sq_head >= RING_NSQ)
+		return -E_NO_MEM;
+	if (num == SYS_page_map && a1 == 0)
+		pager_prefault((void *) a2, PGSIZE);
+	else if (num == SYS_ipc_try_send && a3 < UTOP)
+		pager_prefault((void *) a3, PGSIZE);
+	sc = &ring->sr_sq[tail % RING_NSQ];
+	sc->sc_num = num;
+	sc->sc_args[0] = a1;
+	sc->sc_args[1] = a2;
+	sc->sc_args[2] = a3;
+	sc->sc_args[3] = a4;
+	sc->sc_args[4] = a5;
+	ring->sr_sq_tail = tail + 1;
+	return 0;
+}
+
+// Take the next completion off the ring into *rc.  If there is none
+// and 'wait' is set, have the kernel drain the ring and sleep until
+// one is posted.  Returns 1 if a completion was taken, 0 if there was
+// none, or < 0 on error.
+int
+ring_reap(struct RingCompletion *rc, bool wait)
+{
+	uint32_t head = ring->sr_cq_head;
+	int r;
+
+	if (ring_owner != thisenv->env_id)
+		return -E_INVAL;
+	while (head == ring->sr_cq_tail) {
+		if (!wait)
+			return 0;
+		if ((r = sys_ring_enter(RING_WAIT)) < 0 && r != -E_TIMEOUT)
+			return r;
+	}
+	rc->rc_seq = ring->sr_cq[head % RING_NCQ].rc_seq;
+	rc->rc_ret = ring->sr_cq[head % RING_NCQ].rc_ret;
+	ring->sr_cq_head = head + 1;
+	return 1;
+}
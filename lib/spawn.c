@@ -5,11 +5,18 @@
 #define UTEMP2			(UTEMP + PGSIZE)
 #define UTEMP3			(UTEMP2 + PGSIZE)
 
+// Where spawn maps the program file for sys_exec, below the fd table
+#define EXECIMAGE		0xB0000000
+#define EXECIMAGE_MAX		0x10000000
+
+// Page fault upcall of the child (lib/pfentry.S)
+extern void _pager_upcall(void);
+
 // Helper functions for spawn.
 static int init_stack(envid_t child, const char **argv, uintptr_t *init_esp);
-static int map_segment(envid_t child, uintptr_t va, size_t memsz,
-		       int fd, size_t filesz, off_t fileoffset, int perm);
-static int copy_shared_pages(envid_t child);
+static int map_image(int fd, struct Elf *elf, size_t *len_store);
+static void unmap_image(size_t len);
+static int init_pager(envid_t child, int fd, struct Elf *elf);
 
 // Spawn a child process from a program image loaded from the file system.
 // prog: the pathname of the program to run.
@@ -23,10 +30,9 @@ spawn(const char *prog, const char **argv)
 	struct Trapframe child_tf;
 	envid_t child;
 
-	int fd, i, r;
+	int fd, r;
 	struct Elf *elf;
-	struct Proghdr *ph;
-	int perm;
+	size_t len;
 
 	// This code follows this procedure:
 	//
@@ -42,43 +48,17 @@ spawn(const char *prog, const char **argv)
 	//   - Call the init_stack() function above to set up
 	//     the initial stack page for the child environment.
 	//
-	//   - Map all of the program's segments that are of p_type
-	//     ELF_PROG_LOAD into the new environment's address space.
-	//     Use the p_flags field in the Proghdr for each segment
-	//     to determine how to map the segment:
-	//
-	//	* If the ELF flags do not include ELF_PROG_FLAG_WRITE,
-	//	  then the segment contains text and read-only data.
-	//	  Use read_map() to read the contents of this segment,
-	//	  and map the pages it returns directly into the child
-	//        so that multiple instances of the same program
-	//	  will share the same copy of the program text.
-	//        Be sure to map the program text read-only in the child.
-	//        Read_map is like read but returns a pointer to the data in
-	//        *blk rather than copying the data into another buffer.
-	//
-	//	* If the ELF segment flags DO include ELF_PROG_FLAG_WRITE,
-	//	  then the segment contains read/write data and bss.
-	//	  As with load_icode() in Lab 3, such an ELF segment
-	//	  occupies p_memsz bytes in memory, but only the FIRST
-	//	  p_filesz bytes of the segment are actually loaded
-	//	  from the executable file - you must clear the rest to zero.
-	//        For each page to be mapped for a read/write segment,
-	//        allocate a page in the parent temporarily at UTEMP,
-	//        read() the appropriate portion of the file into that page
-	//	  and/or use memset() to zero non-loaded portions.
-	//	  (You can avoid calling memset(), if you like, if
-	//	  page_alloc() returns zeroed pages already.)
-	//        Then insert the page mapping into the child.
-	//        Look at init_stack() for inspiration.
-	//        Be sure you understand why you can't use read_map() here.
-	//
-	//     Note: None of the segment addresses or lengths above
-	//     are guaranteed to be page-aligned, so you must deal with
-	//     these non-page-aligned values appropriately.
-	//     The ELF linker does, however, guarantee that no two segments
-	//     will overlap on the same page; and it guarantees that
-	//     PGOFF(ph->p_offset) == PGOFF(ph->p_va).
+	//   - Map the ELF headers of the program file read-only at
+	//     EXECIMAGE with read_map(), and have sys_exec() set up the
+	//     child from there.  The kernel reserves the program's
+	//     segments, leaving BSS and the stack below the first page
+	//     demand-zero, maps libjos (kern/shlib.c), and copies our
+	//     PTE_SHARE pages, such as the file descriptor table, into
+	//     the child.  init_pager() then sets up the child to page in
+	//     the rest of the program file as it touches it (see
+	//     lib/pager.c): read-only pages share the file server's block
+	//     cache, so that multiple instances of the same program share
+	//     the same copy of the program text.
 	//
 	//   - Call sys_env_set_trapframe(child, &child_tf) to set up the
 	//     correct initial eip and esp values in the child.
@@ -112,25 +92,17 @@ spawn(const char *prog, const char **argv)
 		return r;
 	child_tf.tf_esp = tf_esp;
 
-	// Set up program segments as defined in ELF header.
-	ph = (struct Proghdr*) (elf_buf + elf->e_phoff);
-	for (i = 0; i < elf->e_phnum; i++, ph++) {
-		if (ph->p_type != ELF_PROG_LOAD)
-			continue;
-		perm = PTE_P | PTE_U;
-		if (ph->p_flags & ELF_PROG_FLAG_WRITE)
-			perm |= PTE_W;
-		if ((r = map_segment(child, ph->p_va, ph->p_memsz,
-				     fd, ph->p_filesz, ph->p_offset, perm)) < 0)
-			goto error;
-	}
+	// Load the program and copy shared library state.
+	if ((r = map_image(fd, elf, &len)) == 0)
+		r = sys_exec(child, (void *) EXECIMAGE, len);
+	unmap_image(len);
+	if (r == 0)
+		r = init_pager(child, fd, elf);
+	if (r < 0)
+		goto error;
 	close(fd);
 	fd = -1;
 
-	// Copy shared library state.
-	if ((r = copy_shared_pages(child)) < 0)
-		panic("copy_shared_pages: %e", r);
-
 	child_tf.tf_eflags |= FL_IOPL_3;   // devious: see user/faultio.c
 	if ((r = sys_env_set_trapframe(child, &child_tf)) < 0)
 		panic("sys_env_set_trapframe: %e", r);
@@ -262,75 +234,98 @@ error:
 	return r;
 }
 
+// Map the pages of the program file 'fd' that sys_exec() reads, those
+// holding the ELF headers, at the same offsets from EXECIMAGE.
+// *len_store is set to how much of the file is mapped, also on error,
+// for unmap_image().
 static int
-map_segment(envid_t child, uintptr_t va, size_t memsz,
-	int fd, size_t filesz, off_t fileoffset, int perm)
+map_image(int fd, struct Elf *elf, size_t *len_store)
 {
-	int i, r;
-	void *blk;
-
-	//cprintf("map_segment %x+%x\n", va, memsz);
-
-	if ((i = PGOFF(va))) {
-		va -= i;
-		memsz += i;
-		filesz += i;
-		fileoffset -= i;
-	}
+	size_t off, end;
+	int r;
 
-	for (i = 0; i < memsz; i += PGSIZE) {
-		if (i >= filesz) {
-			// allocate a blank page
-			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
-				return r;
-		} else {
-			// from file
-			if (~perm & PTE_W)
-			{
-				// use read_map() to share read-only pages 
-				// between environments
-				if ((r = read_map(fd, UTEMP, fileoffset + i, perm)) < 0)
-					return r;
-				if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm)) < 0)
-					panic("spawn: sys_page_map sharing data: %e", r);
-				sys_page_unmap(0, UTEMP);
-
-				continue;
-			}
-			if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
-				return r;
-			if ((r = seek(fd, fileoffset + i)) < 0)
-				return r;
-			if ((r = readn(fd, UTEMP, MIN(PGSIZE, filesz-i))) < 0)
-				return r;
-			if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm)) < 0)
-				panic("spawn: sys_page_map data: %e", r);
-			sys_page_unmap(0, UTEMP);
-		}
+	*len_store = 0;
+	end = elf->e_phoff + elf->e_phnum * sizeof(struct Proghdr);
+	if (end > EXECIMAGE_MAX)
+		return -E_NO_MEM;
+	for (off = 0; off < end; off += PGSIZE) {
+		*len_store = off + PGSIZE;
+		if ((r = read_map(fd, (void *) (EXECIMAGE + off), off,
+				  PTE_P | PTE_U)) < 0)
+			return r;
 	}
 	return 0;
 }
 
-// Copy the mappings for shared pages into the child address space.
+// Unmap what map_image() mapped.
+static void
+unmap_image(size_t len)
+{
+	struct Syscall calls[16];
+	struct SyscallBatch b = { calls, 0, ARRAY_SIZE(calls) };
+	size_t off;
+
+	for (off = 0; off < len; off += PGSIZE)
+		if (uvpd[PDX(EXECIMAGE + off)] & PTE_P &&
+		    uvpt[PGNUM(EXECIMAGE + off)] & PTE_P)
+			batch_add(&b, SYS_page_unmap, 0, EXECIMAGE + off, 0, 0, 0);
+	batch_flush(&b);
+}
+
+// Set up the pager of the child (see lib/pager.c): describe
+// the segments of the program file 'fd' that it pages in at UPAGERINFO,
+// keep the file open by mapping its struct Fd at UPAGERFD, and give the
+// child an exception stack and _pager_upcall as its page fault upcall.
 static int
-copy_shared_pages(envid_t child)
+init_pager(envid_t child, int fd, struct Elf *elf)
 {
-	// LAB 5: Your code here.
-	int r;
-	for (int i = 0; i < PDX(UTOP); i++) if (uvpd[i] & PTE_P)
-	{
-		for (int j = 0; j < NPTENTRIES; j++)
-		{
-			void *addr = PGADDR(i, j, 0);
-			pte_t pte = uvpt[PGNUM(addr)];
-			if ((pte & PTE_P) && (pte & PTE_SHARE))
-			{
-				int perm = pte & PTE_SYSCALL;
-				if ((r = sys_page_map(0, addr, child, addr, perm)) < 0)
-					return r;
-			}
+	struct Syscall calls[8];
+	struct SyscallBatch b = { calls, 0, ARRAY_SIZE(calls) };
+	struct PagerInfo *pi = (struct PagerInfo *) UTEMP;
+	struct PagerSeg *ps;
+	struct Proghdr *ph;
+	struct Fd *fdp;
+	int i, r;
+
+	if ((r = fd_lookup(fd, &fdp)) < 0)
+		return r;
+	if ((r = sys_page_alloc(0, UTEMP, PTE_P | PTE_U | PTE_W)) < 0)
+		return r;
+
+	pi->pi_fsenv = ipc_find_env(ENV_TYPE_FS);
+	pi->pi_fileid = fdp->fd_file.id;
+	pi->pi_version = fdp->fd_file.version;
+	pi->pi_nseg = 0;
+	ph = (struct Proghdr *) ((uint8_t *) elf + elf->e_phoff);
+	for (i = 0; i < elf->e_phnum; i++) {
+		if (ph[i].p_type != ELF_PROG_LOAD || ph[i].p_filesz == 0)
+			continue;
+		if (pi->pi_nseg == PAGER_NSEG) {
+			r = -E_NOT_EXEC;
+			goto out;
 		}
+		ps = &pi->pi_seg[pi->pi_nseg++];
+		ps->ps_va = ph[i].p_va;
+		ps->ps_fend = ph[i].p_va + ph[i].p_filesz;
+		ps->ps_end = ph[i].p_va + ph[i].p_memsz;
+		ps->ps_offset = ph[i].p_offset;
+		ps->ps_perm = PTE_P | PTE_U;
+		if (ph[i].p_flags & ELF_PROG_FLAG_WRITE)
+			ps->ps_perm |= PTE_W;
 	}
-	return 0;
-}
 
+	batch_add(&b, SYS_page_map, 0, (uint32_t) UTEMP,
+		  child, (uint32_t) UPAGERINFO, PTE_P | PTE_U);
+	batch_add(&b, SYS_page_map, 0, (uint32_t) fdp,
+		  child, (uint32_t) UPAGERFD, PTE_P | PTE_U);
+	batch_add(&b, SYS_page_alloc, child, (uint32_t) UPAGERREQ,
+		  PTE_P | PTE_U | PTE_W, 0, 0);
+	batch_add(&b, SYS_page_alloc, child, UXSTACKTOP - PGSIZE,
+		  PTE_P | PTE_U | PTE_W, 0, 0);
+	batch_add(&b, SYS_env_set_pgfault_upcall, child, (uint32_t) _pager_upcall,
+		  0, 0, 0);
+	r = batch_flush(&b);
+out:
+	sys_page_unmap(0, UTEMP);
+	return r;
+}
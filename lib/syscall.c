@@ -3,6 +3,30 @@
 #include <inc/syscall.h>
 #include <inc/lib.h>
 
+// Fast system call through SYSENTER (see sysenter_entry in
+// kern/trapentry.S).  SYSEXIT returns to the %eip and %esp passed in
+// %esi and %ebp, and clobbers %ecx and %edx; %ebp is saved on the
+// stack since it may be the frame pointer.  Only four arguments fit.
+static inline int32_t
+syscall_sysenter(int num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4)
+{
+	int32_t ret;
+
+	asm volatile("pushl %%ebp\n"
+		     "movl %%esp, %%ebp\n"
+		     "leal 1f, %%esi\n"
+		     "sysenter\n"
+		     "1: popl %%ebp\n"
+		     : "=a" (ret),
+		       "+d" (a1),
+		       "+c" (a2)
+		     : "a" (num),
+		       "b" (a3),
+		       "D" (a4)
+		     : "esi", "cc", "memory");
+	return ret;
+}
+
 static inline int32_t
 syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
 {
@@ -19,17 +43,29 @@ syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	// The last clause tells the assembler that this can
 	// potentially change the condition codes and arbitrary
 	// memory locations.
+	//
+	// The kernel passes 0 for a fifth argument made with SYSENTER,
+	// so only calls that need a nonzero one take the slower int.
+	//
+	// A call passed memory that our pager (lib/pager.c) has yet to
+	// page in fails with -E_PAGEIN, once the kernel has had the pager
+	// page it in: make it again.
 
-	asm volatile("int %1\n"
-		     : "=a" (ret)
-		     : "i" (T_SYSCALL),
-		       "a" (num),
-		       "d" (a1),
-		       "c" (a2),
-		       "b" (a3),
-		       "D" (a4),
-		       "S" (a5)
-		     : "cc", "memory");
+	do {
+		if (a5 == 0 && ustats.us_sysenter)
+			ret = syscall_sysenter(num, a1, a2, a3, a4);
+		else
+			asm volatile("int %1\n"
+				     : "=a" (ret)
+				     : "i" (T_SYSCALL),
+				       "a" (num),
+				       "d" (a1),
+				       "c" (a2),
+				       "b" (a3),
+				       "D" (a4),
+				       "S" (a5)
+				     : "cc", "memory");
+	} while (ret == -E_PAGEIN);
 
 	if(check && ret > 0)
 		panic("syscall %d returned %d (> 0)", num, ret);
@@ -67,6 +103,12 @@ sys_yield(void)
 	syscall(SYS_yield, 0, 0, 0, 0, 0, 0);
 }
 
+void
+sys_yield_to(envid_t envid)
+{
+	syscall(SYS_yield_to, 0, envid, 0, 0, 0, 0);
+}
+
 int
 sys_page_alloc(envid_t envid, void *va, int perm)
 {
@@ -87,12 +129,42 @@ sys_page_unmap(envid_t envid, void *va)
 
 // sys_exofork is inlined in lib.h
 
+envid_t
+sys_fork(void)
+{
+	return syscall(SYS_fork, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_exec(envid_t envid, const void *image, size_t len)
+{
+	return syscall(SYS_exec, 1, envid, (uint32_t) image, len, 0, 0);
+}
+
+int
+sys_region_reserve(envid_t envid, void *va, size_t len, int perm)
+{
+	return syscall(SYS_region_reserve, 1, envid, (uint32_t) va, len, perm, 0);
+}
+
+int
+sys_env_set_faultaround(envid_t envid, int npages)
+{
+	return syscall(SYS_env_set_faultaround, 1, envid, npages, 0, 0, 0);
+}
+
 int
 sys_env_set_status(envid_t envid, int status)
 {
 	return syscall(SYS_env_set_status, 1, envid, status, 0, 0, 0);
 }
 
+int
+sys_env_set_affinity(envid_t envid, uint32_t cpumask)
+{
+	return syscall(SYS_env_set_affinity, 1, envid, cpumask, 0, 0, 0);
+}
+
 int
 sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 {
@@ -117,3 +189,85 @@ sys_ipc_recv(void *dstva)
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+int
+sys_ipc_recv_from(envid_t from, void *dstva)
+{
+	return syscall(SYS_ipc_recv_from, 1, from, (uint32_t) dstva, 0, 0, 0);
+}
+
+int
+sys_cgetc_wait(void)
+{
+	return syscall(SYS_cgetc_wait, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_env_wait(envid_t envid)
+{
+	return syscall(SYS_env_wait, 0, envid, 0, 0, 0, 0);
+}
+
+int
+sys_futex_wait(const volatile void *addr, uint32_t expected, uint32_t timeout)
+{
+	return syscall(SYS_futex_wait, 0, (uint32_t) addr, expected, timeout, 0, 0);
+}
+
+int
+sys_futex_wake(const volatile void *addr, int n)
+{
+	return syscall(SYS_futex_wake, 0, (uint32_t) addr, n, 0, 0, 0);
+}
+
+int
+sys_sleep(uint32_t usec)
+{
+	return syscall(SYS_sleep, 0, usec, 0, 0, 0, 0);
+}
+
+// Microseconds since boot.  The kernel returns the high half in %edx,
+// which syscall() does not pass back.
+uint64_t
+sys_time(void)
+{
+	uint64_t t;
+
+	asm volatile("int %1\n"
+		     : "=A" (t)
+		     : "i" (T_SYSCALL),
+		       "a" (SYS_time)
+		     : "cc", "memory");
+	return t;
+}
+
+
+// The kernel stops a batch before a call whose memory must be paged in
+// first, once it has had it paged in, and returns the number of calls
+// made before it: go on from that call.  Nothing else makes a batch
+// come back short but a call failing under BATCH_STOPONERR.
+int
+sys_batch(struct Syscall *calls, int n, int flags)
+{
+	int r, done = 0;
+
+	while ((r = syscall(SYS_batch, 0, (uint32_t) (calls + done),
+			    n - done, flags, 0, 0)) >= 0) {
+		done += r;
+		if (done == n || ((flags & BATCH_STOPONERR) && r > 0 &&
+				  calls[done - 1].sc_ret < 0))
+			return done;
+	}
+	return r;
+}
+
+int
+sys_ring_setup(void *va)
+{
+	return syscall(SYS_ring_setup, 0, (uint32_t) va, 0, 0, 0, 0);
+}
+
+int
+sys_ring_enter(int flags)
+{
+	return syscall(SYS_ring_enter, 0, flags, 0, 0, 0, 0);
+}
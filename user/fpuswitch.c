@@ -0,0 +1,45 @@
+// Check that x87 and SSE registers survive context switches: several
+// envs keep a value of their own in the FPU across sys_yield().
+
+#include <inc/lib.h>
+
+#define NCHILD	4
+#define NROUNDS	100
+
+// Load v into st(0) and %xmm0, yield, and read both back.  User code
+// is not built with SSE, so the compiler never touches %xmm0 itself.
+static void
+fpu_yield(uint32_t v, uint32_t *x87, uint32_t *sse)
+{
+	uint32_t a = SYS_yield;
+
+	asm volatile("fildl %3\n\t"
+		     "movd %3, %%xmm0\n\t"
+		     "int %4\n\t"
+		     "fistpl %1\n\t"
+		     "movd %%xmm0, %2"
+		     : "+a" (a), "=m" (*x87), "=r" (*sse)
+		     : "m" (v), "i" (T_SYSCALL)
+		     : "cc", "memory");
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t v, x87, sse;
+	int i;
+
+	for (i = 0; i < NCHILD; i++)
+		if (fork() == 0)
+			break;
+
+	for (i = 0; i < NROUNDS; i++) {
+		v = (thisenv->env_id << 8) | i;
+		fpu_yield(v, &x87, &sse);
+		if (x87 != v || sse != v)
+			panic("FPU state lost: wrote %08x, read x87 %08x sse %08x",
+			      v, x87, sse);
+	}
+	cprintf("%08x: FPU state kept over %d switches\n",
+		thisenv->env_id, NROUNDS);
+}
@@ -0,0 +1,41 @@
+// Time the null system call, sys_getenvid(), through SYSENTER and
+// through int $T_SYSCALL, and check that both return the right id.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NCALLS	10000
+
+static envid_t
+getenvid_int(void)
+{
+	envid_t id;
+
+	asm volatile("int %1"
+		     : "=a" (id)
+		     : "i" (T_SYSCALL), "a" (SYS_getenvid)
+		     : "cc", "memory");
+	return id;
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t t0, t1, t2;
+	int i;
+
+	t0 = read_tsc();
+	for (i = 0; i < NCALLS; i++)
+		if (sys_getenvid() != thisenv->env_id)
+			panic("sys_getenvid returned the wrong id");
+	t1 = read_tsc();
+	for (i = 0; i < NCALLS; i++)
+		if (getenvid_int() != thisenv->env_id)
+			panic("int $T_SYSCALL returned the wrong id");
+	t2 = read_tsc();
+
+	cprintf("null syscall (%s): %llu cycles\n",
+		ustats.us_sysenter ? "sysenter" : "int",
+		(t1 - t0) / NCALLS);
+	cprintf("null syscall (int): %llu cycles\n", (t2 - t1) / NCALLS);
+}
@@ -0,0 +1,67 @@
+// Make system calls through a system call ring: map pages, sleep and
+// unmap them again, with only the waits trapping into the kernel.
+
+#include <inc/lib.h>
+
+#define NPAGES		16
+#define SLEEP_USEC	20000
+
+static int
+reap_all(int n)
+{
+	struct RingCompletion rc;
+	int i, r;
+
+	for (i = 0; i < n; i++) {
+		if ((r = ring_reap(&rc, true)) < 0)
+			panic("ring_reap: %e", r);
+		if (rc.rc_ret < 0)
+			panic("submission %d failed: %e", rc.rc_seq, rc.rc_ret);
+	}
+	return 0;
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct RingCompletion rc;
+	uint64_t t0, t1;
+	char *va;
+	int i, r;
+
+	if ((r = ring_open()) < 0)
+		panic("ring_open: %e", r);
+
+	// Calls that could block are refused
+	if ((r = ring_submit(SYS_yield, 0, 0, 0, 0, 0)) < 0)
+		panic("ring_submit: %e", r);
+	if ((r = ring_reap(&rc, true)) < 0 || rc.rc_ret != -E_INVAL)
+		panic("SYS_yield on the ring returned %e", rc.rc_ret);
+
+	t0 = sys_time();
+	for (i = 0; i < NPAGES; i++)
+		if ((r = ring_submit(SYS_page_alloc, 0, (uint32_t) UTEMP + i * PGSIZE,
+				     PTE_P | PTE_U | PTE_W, 0, 0)) < 0)
+			panic("ring_submit: %e", r);
+	if ((r = ring_submit(SYS_sleep, SLEEP_USEC, 0, 0, 0, 0)) < 0)
+		panic("ring_submit: %e", r);
+	reap_all(NPAGES + 1);
+	t1 = sys_time();
+	if (t1 - t0 < SLEEP_USEC)
+		panic("sleep on the ring took only %llu us", t1 - t0);
+
+	for (i = 0; i < NPAGES; i++) {
+		va = (char *) UTEMP + i * PGSIZE;
+		if (!(uvpd[PDX(va)] & PTE_P) || !(uvpt[PGNUM(va)] & PTE_P))
+			panic("page %d not mapped", i);
+		va[0] = i;
+		if ((r = ring_submit(SYS_page_unmap, 0, (uint32_t) va, 0, 0, 0)) < 0)
+			panic("ring_submit: %e", r);
+	}
+	reap_all(NPAGES);
+	for (i = 0; i < NPAGES; i++)
+		if (uvpt[PGNUM(UTEMP + i * PGSIZE)] & PTE_P)
+			panic("page %d still mapped", i);
+
+	cprintf("ringtest OK\n");
+}
@@ -0,0 +1,83 @@
+// Test sys_batch: calls are made in order with their results stored,
+// BATCH_STOPONERR stops after the first failure, and calls that cannot
+// be batched fail with -E_INVAL without disturbing the rest.
+
+#include <inc/lib.h>
+
+#define NOTRUN	0x12345678
+
+static struct Syscall calls[8];
+
+static void
+set(int i, int num, uint32_t a1, uint32_t a2, uint32_t a3)
+{
+	calls[i].sc_num = num;
+	calls[i].sc_args[0] = a1;
+	calls[i].sc_args[1] = a2;
+	calls[i].sc_args[2] = a3;
+	calls[i].sc_args[3] = 0;
+	calls[i].sc_args[4] = 0;
+	calls[i].sc_ret = NOTRUN;
+}
+
+void
+umain(int argc, char **argv)
+{
+	char *va = (char *) UTEMP, *va2 = (char *) UTEMP + PGSIZE;
+	int i, r;
+
+	// Calls run in order, each seeing the ones before
+	set(0, SYS_getenvid, 0, 0, 0);
+	set(1, SYS_page_alloc, 0, (uint32_t) va, PTE_P | PTE_U | PTE_W);
+	set(2, SYS_page_map, 0, (uint32_t) va, 0);
+	calls[2].sc_args[3] = (uint32_t) va2;
+	calls[2].sc_args[4] = PTE_P | PTE_U | PTE_W;
+	set(3, SYS_page_unmap, 0, (uint32_t) va, 0);
+	if ((r = sys_batch(calls, 4, 0)) != 4)
+		panic("sys_batch: %e", r);
+	if (calls[0].sc_ret != thisenv->env_id)
+		panic("getenvid returned %08x", calls[0].sc_ret);
+	for (i = 1; i < 4; i++)
+		if (calls[i].sc_ret != 0)
+			panic("call %d: %e", i, calls[i].sc_ret);
+	if ((uvpt[PGNUM(va)] & PTE_P) || !(uvpt[PGNUM(va2)] & PTE_P))
+		panic("batched page calls not made");
+	*va2 = 1;
+
+	// BATCH_STOPONERR stops after the failing call
+	set(0, SYS_getenvid, 0, 0, 0);
+	set(1, SYS_page_unmap, 0, UTOP, 0);
+	set(2, SYS_page_unmap, 0, (uint32_t) va2, 0);
+	if ((r = sys_batch(calls, 3, BATCH_STOPONERR)) != 2)
+		panic("sys_batch stopped after %d calls", r);
+	if (calls[1].sc_ret != -E_INVAL || calls[2].sc_ret != NOTRUN)
+		panic("BATCH_STOPONERR made call 2");
+	if (!(uvpt[PGNUM(va2)] & PTE_P))
+		panic("BATCH_STOPONERR unmapped va2");
+
+	// Calls that may block, yield or return more than %eax are
+	// refused, and the batch goes on
+	set(0, SYS_yield, 0, 0, 0);
+	set(1, SYS_time, 0, 0, 0);
+	set(2, SYS_env_set_affinity, 0, 0, 0);
+	set(3, SYS_sleep, 1000, 0, 0);
+	set(4, SYS_batch, (uint32_t) calls, 1, 0);
+	set(5, SYS_ipc_recv, 0, 0, 0);
+	set(6, SYS_page_unmap, 0, (uint32_t) va2, 0);
+	if ((r = sys_batch(calls, 7, 0)) != 7)
+		panic("sys_batch with refused calls: %e", r);
+	for (i = 0; i < 6; i++)
+		if (calls[i].sc_ret != -E_INVAL)
+			panic("call %d (%d) not refused: %e", i,
+			      calls[i].sc_num, calls[i].sc_ret);
+	if (calls[6].sc_ret != 0 || (uvpt[PGNUM(va2)] & PTE_P))
+		panic("call after refused ones not made");
+
+	// Bad arguments
+	if ((r = sys_batch(calls, 1, ~BATCH_STOPONERR)) != -E_INVAL)
+		panic("sys_batch with bad flags: %e", r);
+	if ((r = sys_batch((struct Syscall *) ULIM, 1, 0)) != -E_FAULT)
+		panic("sys_batch of kernel memory: %e", r);
+
+	cprintf("testbatch OK\n");
+}
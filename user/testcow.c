@@ -0,0 +1,68 @@
+// Test the kernel's copy-on-write fork: the child's writes stay
+// private, and the kernel can still write into copy-on-write memory
+// on our behalf.
+
+#include <inc/lib.h>
+
+static char buf[3 * PGSIZE] = "parent";
+static char window[8 * PGSIZE] __attribute__((aligned(8 * PGSIZE)));
+
+void
+umain(int argc, char **argv)
+{
+	struct Syscall calls[2];
+	envid_t who;
+	uint32_t avoided;
+	int i, r;
+
+	// Copy one page per fault to begin with
+	if ((r = sys_env_set_faultaround(0, 1)) < 0)
+		panic("sys_env_set_faultaround: %e", r);
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		strcpy(buf, "child");
+		buf[2 * PGSIZE] = 'c';
+		exit();
+	}
+	wait(who);
+	if (strcmp(buf, "parent") != 0 || buf[2 * PGSIZE] != 0)
+		panic("child's writes showed up in the parent: %s", buf);
+	if (uvpt[PGNUM(buf + PGSIZE)] & PTE_W)
+		panic("page still writable after a fork");
+
+	// sys_batch stores its results in calls[], on our now
+	// copy-on-write stack
+	if ((who = fork()) == 0)
+		exit();
+	memset(calls, 0, sizeof(calls));
+	calls[0].sc_num = SYS_getenvid;
+	calls[1].sc_num = SYS_getenvid;
+	if ((r = sys_batch(calls, 2, 0)) != 2)
+		panic("sys_batch: %e", r);
+	if (calls[0].sc_ret != thisenv->env_id)
+		panic("sys_batch result lost");
+	wait(who);
+
+	// One write copies the whole 8-page fault-around window
+	for (i = 0; i < 8; i++)
+		window[i * PGSIZE] = i;
+	if ((who = fork()) == 0) {
+		if ((r = sys_env_set_faultaround(0, 8)) < 0)
+			panic("sys_env_set_faultaround: %e", r);
+		avoided = thisenv->env_faults_avoided;
+		window[5 * PGSIZE] = 'c';
+		for (i = 0; i < 8; i++)
+			if (!(uvpt[PGNUM(window + i * PGSIZE)] & PTE_W))
+				panic("fault-around: page %d not copied", i);
+		if (thisenv->env_faults_avoided - avoided != 7)
+			panic("fault-around avoided %d faults, not 7",
+			      thisenv->env_faults_avoided - avoided);
+		exit();
+	}
+	wait(who);
+	if (window[5 * PGSIZE] != 5)
+		panic("child's fault-around write showed up in the parent");
+
+	cprintf("testcow OK\n");
+}
@@ -0,0 +1,199 @@
+// Test lazy loading by spawn: the pages of a spawned program are only
+// mapped once touched, text from the file server's cache and data
+// copy-on-write, system calls may be passed untouched pages, and a
+// handler set with set_pgfault_handler() still gets the faults the
+// pager does not handle.  A program keeps paging in the version of its
+// file it was started from after the file is rewritten, and a version
+// the file server no longer has cannot be read_map()ed.
+
+#include <inc/lib.h>
+#include <inc/elf.h>
+
+#define NPAGES		8
+#define COPY		"/testpager.copy"
+
+static const char text[NPAGES * PGSIZE] = {
+	[0] = 't', [3 * PGSIZE + 1] = 'v', [5 * PGSIZE + 7] = 'x'
+};
+static char data[NPAGES * PGSIZE] = {
+	[0] = 'd', [6 * PGSIZE + 3] = 'y'
+};
+// A page of its own, which nothing touches before it is printed
+#define MSG	"testpager: printing an untouched page\n"
+static const char msg[PGSIZE] __attribute__((aligned(PGSIZE))) = MSG;
+#define BMSG	"testpager: batching an untouched page\n"
+static const char bmsg[PGSIZE] __attribute__((aligned(PGSIZE))) = BMSG;
+
+static bool
+mapped(const void *va)
+{
+	return (uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P);
+}
+
+static void
+handler(struct UTrapframe *utf)
+{
+	int r;
+
+	if (utf->utf_fault_va != (uintptr_t) UTEMP)
+		panic("unexpected fault at %08x", utf->utf_fault_va);
+	if ((r = sys_page_alloc(0, UTEMP, PTE_P | PTE_U | PTE_W)) < 0)
+		panic("sys_page_alloc: %e", r);
+}
+
+static void
+child(void)
+{
+	const char *t = &text[5 * PGSIZE + 7];
+	char *d = &data[6 * PGSIZE + 3];
+	struct Syscall call;
+	int r;
+
+	if (!pager_active())
+		panic("child was not loaded lazily");
+	if (mapped(t) || mapped(d))
+		panic("untouched pages are mapped");
+
+	if (*t != 'x')
+		panic("text reads %02x", *t);
+	if (uvpt[PGNUM(t)] & PTE_W)
+		panic("text page is writable");
+
+	if (*d != 'y')
+		panic("data reads %02x", *d);
+	if ((uvpt[PGNUM(d)] & (PTE_W | PTE_COW)) != PTE_COW)
+		panic("data page is not copy-on-write");
+	*d = 'z';
+	if (*d != 'z' || !(uvpt[PGNUM(d)] & PTE_W))
+		panic("data page was not copied");
+
+	// The kernel is handed pages the program has not touched
+	if (mapped(msg) || mapped(&data[4 * PGSIZE]))
+		panic("untouched pages are mapped");
+	sys_cputs(msg, sizeof(MSG) - 1);
+	if ((r = sys_futex_wake(&data[4 * PGSIZE], 1)) != 0)
+		panic("sys_futex_wake on an untouched page: %e", r);
+	if (mapped(bmsg))
+		panic("untouched pages are mapped");
+	memset(&call, 0, sizeof(call));
+	call.sc_num = SYS_cputs;
+	call.sc_args[0] = (uint32_t) bmsg;
+	call.sc_args[1] = sizeof(BMSG) - 1;
+	if ((r = sys_batch(&call, 1, 0)) != 1 || call.sc_ret != 0)
+		panic("sys_batch on an untouched page: %e, %e", r, call.sc_ret);
+
+	set_pgfault_handler(handler);
+	*(volatile char *) UTEMP = 1;
+	cprintf("testpager OK\n");
+}
+
+// Run from COPY, which the parent rewrites once we have started.
+static void
+version_child(void)
+{
+	const char *v = &text[3 * PGSIZE + 1];
+
+	if (mapped(v))
+		panic("untouched pages are mapped");
+	// Wait for the rewrite
+	ipc_recv(NULL, NULL, NULL);
+	if (*v != 'v')
+		panic("rewritten program reads %02x", *v);
+	cprintf("testpager version OK\n");
+}
+
+static void
+copy_file(const char *src, const char *dst)
+{
+	char buf[512];
+	int fdsrc, fddst, n, r;
+
+	if ((fdsrc = open(src, O_RDONLY)) < 0)
+		panic("open %s: %e", src, fdsrc);
+	if ((fddst = open(dst, O_RDWR | O_CREAT | O_TRUNC)) < 0)
+		panic("open %s: %e", dst, fddst);
+	while ((n = read(fdsrc, buf, sizeof(buf))) > 0)
+		if ((r = write(fddst, buf, n)) != n)
+			panic("write %s: %e", dst, r);
+	if (n < 0)
+		panic("read %s: %e", src, n);
+	close(fdsrc);
+	close(fddst);
+}
+
+// The offset in program file fd of our own address va.
+static off_t
+file_offset(int fd, const void *va)
+{
+	struct Elf elf;
+	struct Proghdr ph;
+	int i;
+
+	if (seek(fd, 0) < 0 || readn(fd, &elf, sizeof(elf)) != sizeof(elf))
+		panic("cannot read the ELF header");
+	for (i = 0; i < elf.e_phnum; i++) {
+		if (seek(fd, elf.e_phoff + i * sizeof(ph)) < 0 ||
+		    readn(fd, &ph, sizeof(ph)) != sizeof(ph))
+			panic("cannot read a program header");
+		if (ph.p_type == ELF_PROG_LOAD && (uintptr_t) va >= ph.p_va &&
+		    (uintptr_t) va < ph.p_va + ph.p_filesz)
+			return ph.p_offset + ((uintptr_t) va - ph.p_va);
+	}
+	panic("%08x is not in the program file", va);
+}
+
+// Overwrite the page of COPY that holds text[3 * PGSIZE] through fd.
+static void
+rewrite(int fd)
+{
+	char buf[512];
+	off_t off;
+	int i, r;
+
+	off = ROUNDDOWN(file_offset(fd, &text[3 * PGSIZE]), sizeof(buf));
+	memset(buf, 'Q', sizeof(buf));
+	for (i = 0; i < PGSIZE / sizeof(buf); i++)
+		if ((r = seek(fd, off + i * sizeof(buf))) < 0 ||
+		    (r = write(fd, buf, sizeof(buf))) != sizeof(buf))
+			panic("rewrite: %e", r);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who;
+	int fd, old, r;
+
+	if (argc > 1 && strcmp(argv[1], "version") == 0) {
+		version_child();
+		return;
+	}
+	if (argc > 1) {
+		child();
+		return;
+	}
+	if ((r = spawnl("/testpager", "testpager", "child", 0)) < 0)
+		panic("spawn: %e", r);
+	wait(r);
+
+	// Rewrite a running program's file under it
+	copy_file("/testpager", COPY);
+	if ((who = spawnl(COPY, "testpager", "version", 0)) < 0)
+		panic("spawn: %e", who);
+	if ((fd = open(COPY, O_RDWR)) < 0)
+		panic("open %s: %e", COPY, fd);
+	rewrite(fd);
+	ipc_send(who, 0, NULL, 0);
+	wait(who);
+
+	// Nothing has been paged in from old's version, so rewriting the
+	// file again drops it
+	if ((old = open(COPY, O_RDONLY)) < 0)
+		panic("open %s: %e", COPY, old);
+	rewrite(fd);
+	if ((r = read_map(old, UTEMP, 0, PTE_P | PTE_U)) != -E_NOT_FOUND)
+		panic("read_map of a dropped version: %e", r);
+	close(old);
+	close(fd);
+	cprintf("testpager old version OK\n");
+}
@@ -0,0 +1,78 @@
+// Test demand-zero regions: pages appear zeroed on first touch, with
+// no user-level page fault handler involved, the kernel can use region
+// memory the env has not touched yet, and fault-around maps a fault's
+// neighbors.
+
+#include <inc/lib.h>
+
+#define NPAGES		64
+
+static void
+handler(struct UTrapframe *utf)
+{
+	panic("upcall for a fault at %08x", utf->utf_fault_va);
+}
+
+void
+umain(int argc, char **argv)
+{
+	char *va = (char *) UTEMP;
+	struct Syscall *sc;
+	envid_t who;
+	uint32_t avoided;
+	int i, r;
+
+	set_pgfault_handler(handler);
+	// One page at a time, to begin with
+	if ((r = sys_env_set_faultaround(0, 1)) < 0)
+		panic("sys_env_set_faultaround: %e", r);
+
+	if ((r = sys_region_reserve(0, va, NPAGES * PGSIZE,
+				    PTE_P | PTE_U | PTE_W)) < 0)
+		panic("sys_region_reserve: %e", r);
+	if ((r = sys_region_reserve(0, va + PGSIZE, PGSIZE,
+				    PTE_P | PTE_U | PTE_W)) != -E_INVAL)
+		panic("overlapping sys_region_reserve: %e", r);
+
+	for (i = 0; i < NPAGES; i += 2) {
+		if (va[i * PGSIZE] != 0)
+			panic("page %d not zero", i);
+		va[i * PGSIZE + 1] = i;
+	}
+
+	// The kernel writes into an untouched page: this call's result
+	// lands on page 1
+	sc = (struct Syscall *) (va + PGSIZE - 8);
+	sc->sc_num = SYS_getenvid;
+	if ((r = sys_batch(sc, 1, 0)) != 1)
+		panic("sys_batch: %e", r);
+	if (sc->sc_ret != thisenv->env_id)
+		panic("sys_batch result lost");
+
+	// A child inherits both the touched and the untouched pages
+	if ((who = fork()) == 0) {
+		for (i = 0; i < NPAGES; i++)
+			if (va[i * PGSIZE + 1] != (i % 2 ? 0 : i))
+				panic("child: page %d wrong", i);
+		exit();
+	}
+	wait(who);
+
+	// Fault-around maps the rest of an aligned 8-page window
+	va += NPAGES * PGSIZE;
+	if ((r = sys_region_reserve(0, va, 16 * PGSIZE,
+				    PTE_P | PTE_U | PTE_W)) < 0)
+		panic("sys_region_reserve: %e", r);
+	if ((r = sys_env_set_faultaround(0, 8)) < 0)
+		panic("sys_env_set_faultaround: %e", r);
+	avoided = thisenv->env_faults_avoided;
+	va[3 * PGSIZE] = 1;
+	for (i = 0; i < 16; i++)
+		if (!!(uvpt[PGNUM(va + i * PGSIZE)] & PTE_P) != (i < 8))
+			panic("fault-around: page %d %smapped", i, i < 8 ? "not " : "");
+	if (thisenv->env_faults_avoided - avoided != 7)
+		panic("fault-around avoided %d faults, not 7",
+		      thisenv->env_faults_avoided - avoided);
+
+	cprintf("testregion OK\n");
+}